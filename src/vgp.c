@@ -3,26 +3,48 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 
 #include "vgplib.h"
 
 
-char pin_name[] = "0A0";
+#define BATCH_LINE_SIZE  1024
+#define BATCH_MAX_ARGS   16
 
-bool pin_changed = false;
+char pin_name[] = "0A0";
 
 // vgp command parameters...
 // vpg help
 // vgp list
 // vgp all
+// vgp save <file>
+// vgp apply <file> [-v]
 // vgp mode 4C2
 // vgp mode 4C2 in/out
 // vgp alt 4C2
 // vgp alt 4C2 0/1/2/3
 // vgp get 4C2
 // vgp set 4C2 0
-// vgp wfi 4C2 rising/falling/both
+// vgp set 4C2=1 4D6=0 ...
+// vgp wfi 4C2 rising/falling/both [-t timeout_ms] [-n count] [-d settle_us] [-v]
 // vgp adc 0/3/4 [v/V]
+// vgp adc stream 0,3,4 [-r rate] [-n frames] [-T trigger] [-f file] [-o file] [-F filter] [v]
+// vgp adcwatch 0/3/4 above/below <level> | outside/inside <low> <high> [-H hysteresis] [-d dwell_ms] [-r rate] [-t timeout_ms] [-n count] [-e] [-v]
+// vgp bus 2A0,2A1,... [value]
+// vgp capture 2A0,2A1,... [-e] [-T pin=edge] [-p pre_us] [-d post_us] [-t timeout_ms] [-n samples] [-o vcd] [-b bin]
+// vgp play <file> [-l loops] [-v]
+// vgp pwm <pin> <frequency> <duty>% [<pin> <frequency> <duty>% ...] [-t seconds]
+// vgp reflex <file> [-t seconds]
+// vgp freq <pin> [-w window_ms] [-n windows] [-d settle_us]
+// vgp pulse <pin> [-w window_ms] [-n windows] [-d settle_us]
+// vgp batch [file]
+// vgp -c "cmd; cmd; ..."
+// vgp stats [-j] <command> ...
 void do_help(int argc, char *const *argv)
 {
   printf("------------------------------------------------------------\n");
@@ -38,28 +60,78 @@ void do_help(int argc, char *const *argv)
   printf("[Supported Commands]\n");
   printf("  list: display 40-pin GPIO information.\n");
   printf("  all: print information for all GPIO pins.\n");
+  printf("  save: write alt, direction and output level of every pin to a profile file (- for stdout).\n");
+  printf("  apply: restore a profile, writing only the registers that differ; -v prints how many.\n");
   printf("  mode: get/set the mode of the pin, could be input or output.\n");
   printf("  alt: get/set the ALT of the pin, could be 0, 1, 2 or 3.\n");
   printf("  get: get the value of the pin, could be 0 or 1.\n");
   printf("  set: set the value of the pin, could be 0 or 1.\n");
+  printf("       with <pin>=<value> pairs the pins are made outputs and each bank is updated at once\n");
   printf("  wfi: wait until the pin status change. Parameter could be rising/falling/both\n");
+  printf("       -t <ms>: give up after the timeout (exit code 2), -n <count>: wait for count edges,\n");
+  printf("       -d <us>: debounce, only count edges after the pin stayed stable for the time,\n");
+  printf("       -v: print the kernel timestamp and wake-up latency of each edge\n");
   printf("  adc: get the ADC value or voltage at A0, A3 or A4.\n");
+  printf("       adc stream <channel,...>: stream samples with the IIO buffer, -r <rate> (default 1000),\n");
+  printf("       -n <frames> (0 until Ctrl+C), -T <trigger> to use an existing trigger, -o <file> records\n");
+  printf("       the raw frames, -f <file> replays them; v prints voltages\n");
+  printf("       -F boxcar:<length>, iir:<cutoff Hz> or cic:<decimation>[:<stages>] filters the samples\n");
+  printf("  adcwatch: wait until the ADC channel is above/below a level or outside/inside a window,\n");
+  printf("       levels are counts, or volts with a V suffix. -H <level>: hysteresis, -d <ms>: dwell time,\n");
+  printf("       -r <rate>: samples per second (default %d), -t <ms>: timeout (exit code 2),\n", ADC_WATCH_RATE);
+  printf("       -n <count>: wait for count times, -e: ignore the level at the start, -v: print each time\n");
+  printf("  bus: read or write the comma separated pins (bit 0 first) as one number.\n");
+  printf("  capture: record the comma separated pins like a logic analyzer, as VCD (stdout or -o) and/or binary (-b)\n");
+  printf("       -e: use edge events instead of reading the registers in a loop, -n <samples>: buffer size,\n");
+  printf("       -T <pin>=rising/falling/both: trigger, -p <time>: keep before the trigger, -d <time>: capture after it\n");
+  printf("       (in us, or with a ns/us/ms/s suffix), -t <ms>: give up waiting for the trigger (exit code 2)\n");
+  printf("  play: play a file of \"<time> <pin>=1/0 ...\" steps on outputs, -l <loops> (0 loops until Ctrl+C),\n");
+  printf("       -v: report the lateness of every step\n");
+  printf("  pwm: software PWM on one or more pins (<pin> <frequency> <duty>%%), until Ctrl+C or -t <seconds>\n");
+  printf("  reflex: load \"<pin> rising/falling/both <pin>=1/0 ...\" rules from a file (or stdin), which set the outputs\n");
+  printf("       from the edge monitor itself, until Ctrl+C or -t <seconds>; prints the edge to write latency\n");
+  printf("  freq: measure the frequency of the input, pulse: measure its high/low pulse widths and duty cycle\n");
+  printf("       -w <ms>: window length (default 1000), -n <count>: windows to report (0 for no end),\n");
+  printf("       -d <us>: debounce\n");
+  printf("  batch: run commands from a file (or stdin), one or more per line separated by ';'.\n");
+  printf("  -c: run the ';' separated commands given as one argument.\n");
+  printf("  stats: run the command and print the count and latency percentiles of every vgplib operation\n");
+  printf("       it made to stderr, -j prints them as JSON (needs vgp built with make VGP_STATS=1)\n");
   printf("  help: print these information.\n");
   printf("  version: print the version information.\n");  
   printf("\n");
+  printf("  When vgpd is running, mode, alt, get, set and adc are sent to it\n");
+  printf("  (set VGP_NO_DAEMON=1 to access the hardware directly).\n");
+  printf("\n");
   printf("[Examples]\n");
   printf("  vpg list\n");
   printf("  vpg all\n");
+  printf("  vpg save boot.profile\n");
+  printf("  vpg apply boot.profile -v\n");
   printf("  vpg mode 4D1 (same as \"vgp mode 7\")\n");
   printf("  vpg mode 4D1 out (same as \"vgp mode 7 out\")\n");
   printf("  vpg alt 2A0 (same as \"vgp alt 3\")\n");
   printf("  vpg alt 2A0 0 (same as \"vgp alt 3 0\")\n");
   printf("  vpg get 4D6 (same as \"vgp get 11\")\n");
   printf("  vpg set 4D6 1 (same as \"vgp set 11 1\")\n");
+  printf("  vpg set 4D6=1 4D2=0 4B0=1 (4D6 and 4D2 change together)\n");
   printf("  vpg wfi 2D3 falling (same as \"vgp wfi 13 falling\")\n");
+  printf("  vpg wfi 2D3 both -n 4 -t 500 -v (wait up to 500ms for 4 edges)\n");
   printf("  vpg adc 0 (will print adc value in range 0~1023)\n");
   printf("  vpg adc 3 v (will print voltage instead)\n");
   printf("  vpg adc 4 V (will print unit after voltage value)\n");
+  printf("  vpg adc stream 0,3,4 -r 10000 -n 50000 > samples.txt\n");
+  printf("  vpg adc stream 0 -r 10000 -F cic:100 v (100 averaged voltages per second)\n");
+  printf("  vpg adcwatch 3 above 2.5V -H 0.1V -d 50 -t 10000\n");
+  printf("  vpg bus 2A0,2A1,2A4,2A6,4D6,4D2,4B0,4B1 0xa5\n");
+  printf("  vpg capture 4C3,4C4 -T 4C3=falling -p 1000 -d 20000 -o uart.vcd\n");
+  printf("  vpg play reset.seq -l 10\n");
+  printf("  vpg pwm 4D6 1000 25%% 4D2 50 50%% -t 10\n");
+  printf("  vpg reflex interlock.rules -t 60\n");
+  printf("  vpg freq 2D3 -w 500 -n 0\n");
+  printf("  vpg -c \"alt 2A0 0; mode 2A0 out; set 2A0 1\"\n");
+  printf("  vpg batch pins.conf\n");
+  printf("  vpg stats -j batch pins.conf\n");
   printf("  vpg help\n");
   printf("  vpg version\n");
   printf("\n");
@@ -99,31 +171,25 @@ bool get_pin_name(const char* pin)
 
 void do_all()
 {
-  int gpio_set_values[5];
-  int gpio_get_values[5];
-  int gpio_directions[5];
+  BoardSnapshot snapshot;
   int i, j, k;
-  int iomux[5][4];
 
+  if (read_board_snapshot(&snapshot) < 0)
+  {
+    fprintf(stderr, "Can not read GPIO registers\n");
+    exit(EXIT_FAILURE);
+  }
   for (i = 0; i < 5; i ++)
   {
-    gpio_set_values[i] = get_register(GPIO_BASE[i] + GPIO_SWPORTA_DR);
-    gpio_get_values[i] = get_register(GPIO_BASE[i] + GPIO_EXT_PORTA);
-    gpio_directions[i] = get_register(GPIO_BASE[i] + GPIO_SWPORTA_DDR);
-
     for (j = 0; j < 4; j ++)
     {
-      iomux[i][j] = (GPIO_IOMUX[i][j] == -1) ? -1 : get_register((i < 2 ? PMUGRF : GRF) + GPIO_IOMUX[i][j]);
-      int set_values = ((gpio_set_values[i] >> (j << 3)) & 0xff);
-      int get_values = ((gpio_get_values[i] >> (j << 3)) & 0xff);
-      int directions = ((gpio_directions[i] >> (j << 3)) & 0xff);
-
       for (k = 0; k < 8; k ++)
       {
-        int alt = (iomux[i][j] == -1) ? 0 : ((iomux[i][j] >> (k << 1)) & 0x03);
-        int direction = ((directions >> k) & 0x01);
-        int value = (((direction == 0 ? get_values : set_values) >> k) & 0x01);
-        printf("GPIO%d_%c%d: ALT=%d, V=%d, %s\n", i, GPIO_GROUP[j], k, alt, value, GPIO_DIRECTION[direction]);
+        int ln = (j << 3) + k;
+        int alt = snapshot_get_alt(&snapshot, i, ln);
+        int direction = snapshot_get_dir(&snapshot, i, ln);
+        int value = snapshot_get_value(&snapshot, i, ln);
+        printf("GPIO%d_%c%d: ALT=%d, V=%d, %s\n", i, GPIO_GROUP[j], k, alt == -1 ? 0 : alt, value, GPIO_DIRECTION[direction]);
       }
     } 
   }
@@ -177,6 +243,12 @@ void align_string(char* string, int length, int align)
 
 void do_list()
 {
+  BoardSnapshot snapshot;
+  if (read_board_snapshot(&snapshot) < 0)
+  {
+    fprintf(stderr, "Can not read GPIO registers\n");
+    exit(EXIT_FAILURE);
+  }
   printf("+------+----------+------+---+----------+---+------+----------+------+\n");
   printf("| GPIO |   Name   | Mode | V | Physical | V | Mode |   Name   | GPIO |\n");
   printf("+------+----------+------+---+----++----+---+------+----------+------+\n");
@@ -192,8 +264,8 @@ void do_list()
     {
       chip_left = get_chip_number((char *)NAMES[left]);
       line_left = get_line_number((char *)NAMES[left]);
-      alt_left = get_alt(chip_left, line_left);
-      dir_left = get_dir(chip_left, line_left);
+      alt_left = snapshot_get_alt(&snapshot, chip_left, line_left);
+      dir_left = snapshot_get_dir(&snapshot, chip_left, line_left);
     }
 
     char gpio_left[6];
@@ -223,7 +295,7 @@ void do_list()
     strcpy(value_left, " ");
     if (!power_pin_left)
     {
-      value_left[0] = 0x30 + get(chip_left, line_left);
+      value_left[0] = 0x30 + snapshot_get_value(&snapshot, chip_left, line_left);
     }
     
     char pin_left[4];
@@ -240,8 +312,8 @@ void do_list()
     {
       chip_right = get_chip_number((char *)NAMES[right]);
       line_right = get_line_number((char *)NAMES[right]);
-      alt_right = get_alt(chip_right, line_right);
-      dir_right = get_dir(chip_right, line_right);
+      alt_right = snapshot_get_alt(&snapshot, chip_right, line_right);
+      dir_right = snapshot_get_dir(&snapshot, chip_right, line_right);
     }
 
     char gpio_right[6];
@@ -271,7 +343,7 @@ void do_list()
     strcpy(value_right, " ");
     if (!power_pin_right)
     {
-      value_right[0] = 0x30 + get(chip_right, line_right);
+      value_right[0] = 0x30 + snapshot_get_value(&snapshot, chip_right, line_right);
     }
     
     char pin_right[4];
@@ -296,6 +368,124 @@ void do_list()
 }
 
 
+// profile lines: <pin> <alt> in/out [<level>], one per header IO pin
+void do_save(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s save <file>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  BoardSnapshot snapshot;
+  if (read_board_snapshot(&snapshot) < 0)
+  {
+    fprintf(stderr, "Can not read GPIO registers\n");
+    exit(EXIT_FAILURE);
+  }
+  FILE *f = (strcmp(argv[2], "-") == 0) ? stdout : fopen(argv[2], "w");
+  if (f == NULL)
+  {
+    perror(argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "# vgp profile: <pin> <alt> in/out [<level>]\n");
+  for (int pin = 1; pin <= 40; pin ++)
+  {
+    if (is_power_pin(pin))
+    {
+      continue;
+    }
+    char * name = (char *)NAMES[pin];
+    int ch = get_chip_number(name);
+    int ln = get_line_number(name);
+    int dir = snapshot_get_dir(&snapshot, ch, ln);
+    fprintf(f, "%s %d %s", name, snapshot_get_alt(&snapshot, ch, ln), dir == GPIO_OUTPUT ? "out" : "in");
+    if (dir == GPIO_OUTPUT)
+    {
+      fprintf(f, " %d", snapshot_get_value(&snapshot, ch, ln));
+    }
+    fprintf(f, "\n");
+  }
+  if (f != stdout && fclose(f) != 0)
+  {
+    perror(argv[2]);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+bool load_profile(const char *path, PinProfile *profile)
+{
+  FILE *f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  profile_init(profile);
+  char line[BATCH_LINE_SIZE];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL)
+  {
+    number ++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+    char *save;
+    char *pin = strtok_r(line, " \t\r\n", &save);
+    if (pin == NULL)
+    {
+      continue;
+    }
+    char *alt = strtok_r(NULL, " \t\r\n", &save);
+    char *dir = strtok_r(NULL, " \t\r\n", &save);
+    char *level = strtok_r(NULL, " \t\r\n", &save);
+    ok = get_pin_name(pin) && alt != NULL && dir != NULL && (strcmp(dir, "in") == 0 || strcmp(dir, "out") == 0)
+      && (level == NULL || strcmp(level, "0") == 0 || strcmp(level, "1") == 0)
+      && profile_set(profile, get_chip_number(pin_name), get_line_number(pin_name), atoi(alt),
+        strcmp(dir, "out") == 0 ? GPIO_OUTPUT : GPIO_INPUT, level != NULL && level[0] == '1') == 0;
+    if (!ok)
+    {
+      fprintf(stderr, "%s:%d: incorrect profile line\n", path, number);
+    }
+  }
+  if (f != stdin)
+  {
+    fclose(f);
+  }
+  return ok;
+}
+
+
+// vgp apply <file> [-v]
+void do_apply(int argc, char *const *argv)
+{
+  if (argc < 3 || (argc > 3 && strcmp(argv[3], "-v") != 0))
+  {
+    fprintf(stderr, "Usage: %s apply <file> [-v]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  PinProfile profile;
+  if (!load_profile(argv[2], &profile))
+  {
+    exit(EXIT_FAILURE);
+  }
+  int written = profile_apply(&profile);
+  if (written < 0)
+  {
+    fprintf(stderr, "Can not apply %s\n", argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  if (argc > 3)
+  {
+    printf("%d registers written\n", written);
+  }
+}
+
+
 void do_mode(int argc, char *const *argv)
 {
   if (argc < 3)
@@ -395,11 +585,58 @@ void do_get(int argc, char *const *argv)
 }
 
 
+// adds "<pin>=1/0" to the bank write
+bool parse_pin_value(const char *arg, BankWrite *bw)
+{
+  const char *eq = strchr(arg, '=');
+  char pin[8];
+  if (eq == NULL || eq - arg >= sizeof(pin) || (eq[1] != '0' && eq[1] != '1') || eq[2] != '\0')
+  {
+    fprintf(stderr, "Expected <pin>=1/0 but got: %s\n", arg);
+    return false;
+  }
+  memcpy(pin, arg, eq - arg);
+  pin[eq - arg] = '\0';
+  if (!get_pin_name(pin))
+  {
+    return false;
+  }
+  bank_write_add(bw, get_chip_number(pin_name), get_line_number(pin_name), eq[1] - '0');
+  return true;
+}
+
+
+// vgp set 4D6=1 4D2=0 ...: all pins of a bank change with one register store
+void do_set_many(int argc, char *const *argv)
+{
+  BankWrite bw;
+  bank_write_init(&bw);
+  for (int i = 2; i < argc; i ++)
+  {
+    if (!parse_pin_value(argv[i], &bw))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (bank_write_apply(&bw) < 0)
+  {
+    fprintf(stderr, "Can not set the pins\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
 void do_set(int argc, char *const *argv)
 {
+  if (argc >= 3 && strchr(argv[2], '=') != NULL)
+  {
+    do_set_many(argc, argv);
+    return;
+  }
   if (argc < 4)
   {
     fprintf(stderr, "Usage: %s set <pin> 1/0\n", argv[0]);
+    fprintf(stderr, "       %s set <pin>=1/0 <pin>=1/0 ...\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   if (get_pin_name(argv[2]))
@@ -436,9 +673,64 @@ int get_io_pin(const char* p)
 }
 
 
-void on_pin_state_changed(void *p)
+// parses the value of a numeric option, an integer of at least min
+bool parse_option_int(const char *option, const char *arg, int min, int *value)
+{
+  char *end;
+  errno = 0;
+  long v = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || errno != 0 || v < min || v > INT_MAX)
+  {
+    fprintf(stderr, "Incorrect value for %s: %s\n", option, arg);
+    return false;
+  }
+  *value = v;
+  return true;
+}
+
+
+bool parse_option_double(const char *option, const char *arg, double min, double *value)
+{
+  char *end;
+  double v = strtod(arg, &end);
+  if (end == arg || *end != '\0' || !isfinite(v) || v < min)
+  {
+    fprintf(stderr, "Incorrect value for %s: %s\n", option, arg);
+    return false;
+  }
+  *value = v;
+  return true;
+}
+
+
+// parses a time like 250us, 1.5ms, 2s or 100ns, plain numbers are microseconds
+bool parse_duration(const char *arg, unsigned long long *ns)
 {
-  pin_changed = true;
+  char *unit;
+  double value = strtod(arg, &unit);
+  double scale = 1000;
+  if (strcmp(unit, "ns") == 0)
+  {
+    scale = 1;
+  }
+  else if (strcmp(unit, "ms") == 0)
+  {
+    scale = 1000000;
+  }
+  else if (strcmp(unit, "s") == 0)
+  {
+    scale = 1000000000;
+  }
+  else if (*unit != '\0' && strcmp(unit, "us") != 0)
+  {
+    return false;
+  }
+  if (unit == arg || value < 0)
+  {
+    return false;
+  }
+  *ns = (unsigned long long)(value * scale + 0.5);
+  return true;
 }
 
 
@@ -446,7 +738,7 @@ void do_wfi(int argc, char *const *argv)
 {
   if (argc < 4)
   {
-    fprintf(stderr, "Usage: %s wfi <pin> rising/falling/both\n", argv[0]);
+    fprintf(stderr, "Usage: %s wfi <pin> rising/falling/both [-t timeout_ms] [-n count] [-d settle_us] [-v]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   int pin = get_io_pin(argv[2]);
@@ -470,11 +762,83 @@ void do_wfi(int argc, char *const *argv)
       fprintf(stderr, "Unknown edge: %s (should be rising/falling/both)\n", argv[3]);
       exit(EXIT_FAILURE);
     }
-    create_monitor_thread(pin, 0, wait_for, on_pin_state_changed);
-    while (!pin_changed)
+    int timeout = -1;
+    int count = 1;
+    int settle = 0;
+    bool verbose = false;
+    for (int i = 4; i < argc; i ++)
+    {
+      if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      {
+        if (!parse_option_int("-t", argv[++ i], 1, &timeout))
+        {
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      {
+        if (!parse_option_int("-n", argv[++ i], 1, &count))
+        {
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+      {
+        if (!parse_option_int("-d", argv[++ i], 1, &settle))
+        {
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(argv[i], "-v") == 0)
+      {
+        verbose = true;
+      }
+      else
+      {
+        fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    EdgeWaiter waiter;
+    if (edge_waiter_open(&waiter, pin, wait_for) < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+    if (settle > 0 && edge_waiter_set_debounce(&waiter, settle) < 0)
+    {
+      edge_waiter_close(&waiter);
+      exit(EXIT_FAILURE);
+    }
+    unsigned long long deadline = get_monotonic_ns() + timeout * 1000000ULL;
+    for (int i = 1; i <= count; i ++)
     {
-      usleep(200000);
+      int remaining = -1;
+      if (timeout >= 0)
+      {
+        unsigned long long now = get_monotonic_ns();
+        remaining = (now >= deadline) ? 0 : (deadline - now + 999999) / 1000000;
+      }
+      EdgeEvent event;
+      int ret = edge_waiter_wait(&waiter, remaining, &event);
+      if (ret < 0)
+      {
+        edge_waiter_close(&waiter);
+        exit(EXIT_FAILURE);
+      }
+      if (ret == 0)
+      {
+        fprintf(stderr, "Timeout after %d of %d edges\n", i - 1, count);
+        edge_waiter_close(&waiter);
+        exit(2);
+      }
+      if (verbose)
+      {
+        long long latency = get_edge_latency_ns(event.timestamp);
+        printf("%d: %s edge at %llu.%09llu, latency %lld ns\n", i, event.edge == GPIO_RISING_EDGE ? "rising" : "falling",
+          event.timestamp / 1000000000ULL, event.timestamp % 1000000000ULL, latency);
+      }
     }
+    edge_waiter_close(&waiter);
   }
   else
   {
@@ -483,8 +847,190 @@ void do_wfi(int argc, char *const *argv)
   }
 }
 
+volatile sig_atomic_t adc_stream_interrupted = 0;
+
+
+void on_adc_stream_signal(int sig)
+{
+  adc_stream_interrupted = 1;
+}
+
+
+// vgp adc stream <ch,ch,...> [-r rate] [-n frames] [-T trigger] [-f file] [-o file] [-F filter] [v]
+void do_adc_stream(int argc, char *const *argv)
+{
+  if (argc < 4)
+  {
+    fprintf(stderr, "Usage: %s adc stream <channel,channel,...> [-r rate] [-n frames] [-T trigger] [-f file] [-o file] [-F filter] [v]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int channels[ADC_CHANNELS];
+  int count = 0;
+  char list[BATCH_LINE_SIZE];
+  strncpy(list, argv[3], sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *save, *p = strtok_r(list, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save))
+  {
+    if (count == ADC_CHANNELS)
+    {
+      fprintf(stderr, "Too many ADC channels\n");
+      exit(EXIT_FAILURE);
+    }
+    char *end;
+    channels[count] = strtol(p, &end, 10);
+    if (end == p || *end != '\0')
+    {
+      fprintf(stderr, "Incorrect ADC channel: %s\n", p);
+      exit(EXIT_FAILURE);
+    }
+    count ++;
+  }
+  if (count == 0)
+  {
+    fprintf(stderr, "No ADC channel given\n");
+    exit(EXIT_FAILURE);
+  }
+  double rate = 1000;
+  int frames = 0;
+  const char *trigger = NULL;
+  const char *input = NULL;
+  const char *output = NULL;
+  const char *filter = NULL;
+  bool volts = false;
+  for (int i = 4; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_double("-r", argv[++ i], 0, &rate))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-n", argv[++ i], 0, &frames))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+    {
+      trigger = argv[++ i];
+    }
+    else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+    {
+      input = argv[++ i];
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      output = argv[++ i];
+    }
+    else if (strcmp(argv[i], "-F") == 0 && i + 1 < argc)
+    {
+      filter = argv[++ i];
+    }
+    else if (strcmp(argv[i], "v") == 0)
+    {
+      volts = true;
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  AdcFilter filters[ADC_CHANNELS];
+  for (int c = 0; c < count; c ++)
+  {
+    if (adc_filter_init(&filters[c], filter, rate) < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  int decimation = adc_filter_decimation(&filters[0]);
+  float scale = volts ? get_adc_scale() : 1.0f;
+
+  AdcStream stream;
+  int ret = (input != NULL) ? adc_stream_open_file(&stream, channels, count, input)
+    : adc_stream_open(&stream, channels, count, rate, trigger);
+  if (ret < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  // decoded samples go to stdout, -o keeps the raw frames to replay with -f
+  if (output != NULL && (stream.record_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    perror(output);
+    adc_stream_close(&stream);
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_adc_stream_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  AdcFrame block[ADC_STREAM_BLOCK_FRAMES];
+  int raw[ADC_STREAM_BLOCK_FRAMES];
+  float filtered[ADC_CHANNELS][ADC_STREAM_BLOCK_FRAMES];
+  long total = 0;
+  int n = 0;
+  while (!adc_stream_interrupted && (frames == 0 || total < frames))
+  {
+    int max = (frames == 0 || frames - total > ADC_STREAM_BLOCK_FRAMES) ? ADC_STREAM_BLOCK_FRAMES : frames - total;
+    if ((n = adc_stream_read(&stream, block, max)) <= 0)
+    {
+      break;
+    }
+    int outputs = 0;
+    for (int c = 0; c < count; c ++)
+    {
+      for (int i = 0; i < n; i ++)
+      {
+        raw[i] = block[i].values[c];
+      }
+      outputs = adc_filter_process(&filters[c], raw, filtered[c], n);
+    }
+    // a decimated output belongs to the last frame it was computed from
+    int first = (decimation - 1 - total % decimation) % decimation;
+    for (int j = 0; j < outputs; j ++)
+    {
+      printf("%lld", block[first + j * decimation].timestamp);
+      for (int c = 0; c < count; c ++)
+      {
+        if (volts)
+        {
+          printf(" %.3f", filtered[c][j] * scale);
+        }
+        else if (filter != NULL)
+        {
+          printf(" %.2f", filtered[c][j]);
+        }
+        else
+        {
+          printf(" %d", (int)filtered[c][j]);
+        }
+      }
+      printf("\n");
+    }
+    total += n;
+  }
+  adc_stream_close(&stream);
+  if (n < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+}
+
+
 void do_adc(int argc, char *const *argv)
 {
+  if (argc >= 3 && strcmp(argv[2], "stream") == 0)
+  {
+    do_adc_stream(argc, argv);
+    return;
+  }
   if (argc < 3)
   {
     fprintf(stderr, "Usage: %s adc <analog-pin> [v/V]\n", argv[0]);
@@ -519,40 +1065,960 @@ void do_adc(int argc, char *const *argv)
   }
 }
 
-void do_version(int argc, char *const *argv)
+// an ADC level in counts, or in volts with a V suffix
+bool parse_adc_level(const char *arg, int *counts)
 {
-   printf("Vivid GPIO utility version: %.2f\n", VGP_VERSION);
+  char *unit;
+  double value = strtod(arg, &unit);
+  if (unit == arg || value < 0 || (*unit != '\0' && strcasecmp(unit, "V") != 0))
+  {
+    return false;
+  }
+  *counts = (*unit != '\0') ? (int)(value / get_adc_scale() + 0.5) : (int)value;
+  return true;
 }
 
-// vgp command parameters...
-// vpg help
-// vgp list
-// vgp all
-// vgp mode 4C2
-// vgp mode 4C2 in/out
-// vgp alt 4C2
-// vgp alt 4C2 0/1/2/3
-// vgp get 4C2
-// vgp set 4C2 0
-// vgp wfi 4C2 rising/falling/both
-// vgp adc 0/3/4 [v/V]
 
-int main(int argc, char *const *argv)
+const char * adc_zone_name(int zone)
 {
-  if (argc == 1)
+  const char *names[] = { "unknown", "low", "inside", "high" };
+  return names[zone];
+}
+
+
+typedef struct {
+  AdcWatch watch;
+  int previous;
+} AdcWatchEvent;
+
+int adc_watch_pipe[2];
+
+
+void on_adc_watch(const AdcWatch *watch, int previous, void *arg)
+{
+  // runs on the watcher thread, hand the change to the waiting main thread
+  AdcWatchEvent event = { *watch, previous };
+  if (write(adc_watch_pipe[1], &event, sizeof(event)) < 0)
   {
-    fprintf(stderr, "Usage: %s <command> <pin> <parameter> ...\n", argv[0]);
-    fprintf(stderr, "Run \"%s --help\" for more information.\n", argv[0]);
-    exit(EXIT_FAILURE);
+    perror("Error signalling ADC watch");
   }
-  if (strcasecmp(argv[1], "all") == 0)
+}
+
+
+// vgp adcwatch <channel> above/below <level> | outside/inside <low> <high> [-H hysteresis] [-d dwell_ms] [-r rate] [-t timeout_ms] [-n count] [-e] [-v]
+void do_adcwatch(int argc, char *const *argv)
+{
+  if (argc < 5)
   {
-    do_all();
+    fprintf(stderr, "Usage: %s adcwatch <analog-pin> above/below <level> | outside/inside <low> <high> [-H hysteresis] [-d dwell_ms] [-r rate] [-t timeout_ms] [-n count] [-e] [-v]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int p = atoi(argv[2]);
+  if (p != 0 && p != 3 && p != 4)
+  {
+    fprintf(stderr, "Incorrect pin: %s (must be 0, 3 or 4)\n", argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  int low = -1;
+  int high = -1;
+  int next = 5;
+  bool ok;
+  if (strcasecmp(argv[3], "above") == 0)
+  {
+    ok = parse_adc_level(argv[4], &high);
+  }
+  else if (strcasecmp(argv[3], "below") == 0)
+  {
+    ok = parse_adc_level(argv[4], &low);
+  }
+  else if (strcasecmp(argv[3], "outside") == 0 || strcasecmp(argv[3], "inside") == 0)
+  {
+    ok = argc > 5 && parse_adc_level(argv[4], &low) && parse_adc_level(argv[5], &high) && low <= high;
+    next = 6;
+  }
+  else
+  {
+    fprintf(stderr, "Unknown condition: %s (should be above/below/outside/inside)\n", argv[3]);
+    exit(EXIT_FAILURE);
+  }
+  if (!ok)
+  {
+    fprintf(stderr, "Incorrect level for %s\n", argv[3]);
+    exit(EXIT_FAILURE);
+  }
+  int hysteresis = 0;
+  double dwell = 0;
+  double rate = ADC_WATCH_RATE;
+  int timeout = -1;
+  int count = 1;
+  bool changes_only = false;
+  bool verbose = false;
+  for (int i = next; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+    {
+      if (!parse_adc_level(argv[++ i], &hysteresis))
+      {
+        fprintf(stderr, "Incorrect hysteresis: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_double("-d", argv[++ i], 0, &dwell))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_double("-r", argv[++ i], 0, &rate))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-t", argv[++ i], 1, &timeout))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-n", argv[++ i], 1, &count))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-e") == 0)
+    {
+      changes_only = true;
+    }
+    else if (strcmp(argv[i], "-v") == 0)
+    {
+      verbose = true;
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (pipe(adc_watch_pipe) < 0)
+  {
+    perror("Can not create pipe");
+    exit(EXIT_FAILURE);
+  }
+  if (adc_watch_start(rate) < 0 || adc_watch_add(p, low, high, hysteresis, (unsigned long long)(dwell * 1e6), on_adc_watch, NULL) < 0)
+  {
+    adc_watch_stop();
+    exit(EXIT_FAILURE);
+  }
+  bool inside = strcasecmp(argv[3], "inside") == 0;
+  unsigned long long deadline = get_monotonic_ns() + timeout * 1000000ULL;
+  int met = 0;
+  while (met < count)
+  {
+    int remaining = -1;
+    if (timeout >= 0)
+    {
+      unsigned long long now = get_monotonic_ns();
+      remaining = (now >= deadline) ? 0 : (deadline - now + 999999) / 1000000;
+    }
+    struct pollfd pfd = { adc_watch_pipe[0], POLLIN, 0 };
+    int ret = poll(&pfd, 1, remaining);
+    if (ret == 0)
+    {
+      fprintf(stderr, "Timeout after %d of %d\n", met, count);
+      adc_watch_stop();
+      exit(2);
+    }
+    AdcWatchEvent event;
+    if (ret < 0 || read(adc_watch_pipe[0], &event, sizeof(event)) != sizeof(event))
+    {
+      perror("Error waiting for the ADC");
+      adc_watch_stop();
+      exit(EXIT_FAILURE);
+    }
+    int zone = event.watch.zone;
+    if ((zone == ADC_ZONE_INSIDE) != inside || (changes_only && event.previous == ADC_ZONE_UNKNOWN))
+    {
+      continue;
+    }
+    met ++;
+    if (verbose)
+    {
+      printf("%d: A%d %s at %llu.%09llu, value %d (%.3fV)\n", met, p, adc_zone_name(zone),
+        event.watch.changed / 1000000000ULL, event.watch.changed % 1000000000ULL,
+        event.watch.value, get_voltage_by_adc(event.watch.value));
+    }
+  }
+  if (verbose && adc_watch_overruns() > 0)
+  {
+    printf("%lu samples missed\n", adc_watch_overruns());
+  }
+  adc_watch_stop();
+}
+
+
+// parses a comma separated pin list into pins, returns the count
+int parse_pin_list(const char *arg, int *pins, int max)
+{
+  int count = 0;
+  char list[BATCH_LINE_SIZE];
+  strncpy(list, arg, sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *save, *p = strtok_r(list, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save))
+  {
+    int pin = get_io_pin(p);
+    if (pin < 0 || count == max)
+    {
+      fprintf(stderr, pin < 0 ? "Incorrect pin: %s\n" : "Too many pins at %s\n", p);
+      exit(EXIT_FAILURE);
+    }
+    pins[count ++] = pin;
+  }
+  return count;
+}
+
+
+// vgp bus 2A0,2A1,4D6 [value]: pins are listed from bit 0 up
+void do_bus(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s bus <pin,pin,...> [value]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int pins[BUS_MAX_PINS];
+  int width = parse_pin_list(argv[2], pins, BUS_MAX_PINS);
+  Bus bus;
+  if (bus_init(&bus, "cli", pins, width) < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  if (argc == 3)
+  {
+    unsigned int word;
+    if (bus_read(&bus, &word) < 0)
+    {
+      fprintf(stderr, "Can not read the bus\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("0x%0*x\n", (width + 3) / 4, word);
+    return;
+  }
+  char *end;
+  unsigned long word = strtoul(argv[3], &end, 0);
+  if (*end != '\0' || (width < 32 && word >> width != 0))
+  {
+    fprintf(stderr, "Incorrect value for a %d bit bus: %s\n", width, argv[3]);
+    exit(EXIT_FAILURE);
+  }
+  // drive the levels before turning the pins into outputs
+  if (bus_write(&bus, word) < 0 || bus_set_dir(&bus, GPIO_OUTPUT) < 0)
+  {
+    fprintf(stderr, "Can not write the bus\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// vgp capture <pins> [-e] [-T pin=edge] [-p pre_us] [-d post_us] [-t timeout_ms] [-n samples] [-o vcd] [-b bin]
+void do_capture(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s capture <pin,pin,...> [-e] [-T pin=rising/falling/both] [-p pre_us] [-d post_us]\n", argv[0]);
+    fprintf(stderr, "       [-t timeout_ms] [-n samples] [-o file.vcd] [-b file.bin]\n");
+    exit(EXIT_FAILURE);
+  }
+  int pins[BUS_MAX_PINS];
+  int width = parse_pin_list(argv[2], pins, BUS_MAX_PINS);
+  int mode = CAPTURE_SAMPLED;
+  int trigger_pin = -1;
+  int trigger_edge = GPIO_BOTH_EDGES;
+  unsigned long long pre_ns = 0;
+  unsigned long long post_ns = 100000000;
+  int timeout = -1;
+  int samples = 65536;
+  const char *vcd_file = NULL;
+  const char *bin_file = NULL;
+  for (int i = 3; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-e") == 0)
+    {
+      mode = CAPTURE_EDGES;
+    }
+    else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+    {
+      char trigger[16];
+      strncpy(trigger, argv[++ i], sizeof(trigger) - 1);
+      trigger[sizeof(trigger) - 1] = '\0';
+      char *edge = strchr(trigger, '=');
+      if (edge != NULL)
+      {
+        *edge ++ = '\0';
+        trigger_edge = strcasecmp(edge, "rising") == 0 ? GPIO_RISING_EDGE : strcasecmp(edge, "falling") == 0 ? GPIO_FALLING_EDGE
+          : strcasecmp(edge, "both") == 0 ? GPIO_BOTH_EDGES : 0;
+      }
+      trigger_pin = get_io_pin(trigger);
+      if (trigger_pin < 0 || trigger_edge == 0)
+      {
+        fprintf(stderr, "Incorrect trigger: %s (should be <pin>=rising/falling/both)\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+    {
+      if (!parse_duration(argv[++ i], &pre_ns))
+      {
+        fprintf(stderr, "Incorrect value for -p: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+    {
+      if (!parse_duration(argv[++ i], &post_ns))
+      {
+        fprintf(stderr, "Incorrect value for -d: %s\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-t", argv[++ i], 1, &timeout))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-n", argv[++ i], 1, &samples))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+    {
+      vcd_file = argv[++ i];
+    }
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+    {
+      bin_file = argv[++ i];
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // the trigger pin is captured too
+  int trigger_bit = -1;
+  for (int bit = 0; bit < width && trigger_pin > 0; bit ++)
+  {
+    if (pins[bit] == trigger_pin)
+    {
+      trigger_bit = bit;
+    }
+  }
+  if (trigger_pin > 0 && trigger_bit < 0)
+  {
+    if (width == BUS_MAX_PINS)
+    {
+      fprintf(stderr, "Too many pins with the trigger pin\n");
+      exit(EXIT_FAILURE);
+    }
+    trigger_bit = width;
+    pins[width ++] = trigger_pin;
+  }
+
+  Bus bus;
+  Capture cap;
+  if (bus_init(&bus, "vgp", pins, width) < 0 || capture_init(&cap, &bus, samples) < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  cap.mode = mode;
+  cap.trigger_bit = trigger_bit;
+  cap.trigger_edge = trigger_edge;
+  cap.pre_ns = pre_ns;
+  cap.post_ns = post_ns;
+  int ret = capture_run(&cap, timeout);
+  if (ret < 0)
+  {
+    capture_free(&cap);
+    exit(EXIT_FAILURE);
+  }
+  if (ret == 0)
+  {
+    fprintf(stderr, "Timeout before the trigger\n");
+    capture_free(&cap);
+    exit(2);
+  }
+  fprintf(stderr, "Captured %d changes from %lu %s%s", cap.count, cap.polls, mode == CAPTURE_EDGES ? "edges" : "reads",
+    cap.truncated ? ", buffer full" : "");
+  if (cap.lost > 0)
+  {
+    fprintf(stderr, ", %llu edges lost", cap.lost);
+  }
+  fprintf(stderr, "\n");
+
+  FILE *f = (vcd_file != NULL) ? fopen(vcd_file, "w") : (bin_file == NULL ? stdout : NULL);
+  if ((vcd_file != NULL && f == NULL) || (f != NULL && capture_write_vcd(&cap, f) < 0))
+  {
+    perror("Can not write VCD");
+    ret = -1;
+  }
+  if (f != NULL && f != stdout)
+  {
+    fclose(f);
+  }
+  if (bin_file != NULL)
+  {
+    f = fopen(bin_file, "wb");
+    if (f == NULL || capture_write_binary(&cap, f) < 0)
+    {
+      perror("Can not write capture file");
+      ret = -1;
+    }
+    if (f != NULL)
+    {
+      fclose(f);
+    }
+  }
+  capture_free(&cap);
+  if (ret < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+
+// sequence file: "<time> <pin>=1/0 ..." steps in time order, "period <time>"
+// sets the loop length, '#' starts a comment
+bool load_sequence(const char *path, Sequence *seq)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    return false;
+  }
+  char line[BATCH_LINE_SIZE];
+  int number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL)
+  {
+    number ++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+    char *save;
+    char *time = strtok_r(line, " \t\r\n", &save);
+    if (time == NULL)
+    {
+      continue;
+    }
+    unsigned long long offset;
+    if (strcmp(time, "period") == 0)
+    {
+      char *arg = strtok_r(NULL, " \t\r\n", &save);
+      ok = (arg != NULL && parse_duration(arg, &seq->period_ns));
+    }
+    else if (parse_duration(time, &offset))
+    {
+      BankWrite bw;
+      bank_write_init(&bw);
+      for (char *arg = strtok_r(NULL, " \t\r\n", &save); ok && arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save))
+      {
+        ok = parse_pin_value(arg, &bw);
+      }
+      ok = ok && sequence_add_step(seq, offset, &bw) == 0;
+    }
+    else
+    {
+      ok = false;
+    }
+    if (!ok)
+    {
+      fprintf(stderr, "%s:%d: incorrect sequence line\n", path, number);
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+
+void on_play_signal(int sig)
+{
+  sequence_stop();
+}
+
+
+void print_lateness(const char *label, const RunningStats *stats)
+{
+  printf("%-12s %8lu steps, lateness min %.1f us, mean %.1f us, max %.1f us, stddev %.1f us\n", label, stats->count,
+    stats->min / 1000, stats->mean / 1000, stats->max / 1000, running_stats_stddev(stats) / 1000);
+}
+
+
+// vgp play <file> [-l loops] [-v]
+void do_play(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s play <file> [-l loops] [-v]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int loops = 1;
+  bool verbose = false;
+  for (int i = 3; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-l", argv[++ i], 0, &loops))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-v") == 0)
+    {
+      verbose = true;
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  Sequence seq;
+  sequence_init(&seq);
+  if (!load_sequence(argv[2], &seq))
+  {
+    sequence_free(&seq);
+    exit(EXIT_FAILURE);
+  }
+  // Ctrl+C ends a looping sequence and still prints the report
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_play_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  RunningStats lateness;
+  int played = sequence_play(&seq, loops, &lateness);
+  if (played >= 0)
+  {
+    print_lateness("total", &lateness);
+    for (int i = 0; verbose && i < seq.count; i ++)
+    {
+      char label[32];
+      snprintf(label, sizeof(label), "step %d", i + 1);
+      print_lateness(label, &seq.steps[i].lateness);
+    }
+  }
+  sequence_free(&seq);
+  if (played < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+}
+
+volatile sig_atomic_t pwm_interrupted = 0;
+
+
+void on_pwm_signal(int sig)
+{
+  pwm_interrupted = 1;
+}
+
+
+// vgp pwm <pin> <frequency> <duty>% [<pin> <frequency> <duty>% ...] [-t seconds]
+void do_pwm(int argc, char *const *argv)
+{
+  int pins[MONITOR_PINS];
+  double frequencies[MONITOR_PINS];
+  double duties[MONITOR_PINS];
+  int count = 0;
+  double seconds = 0;
+  for (int i = 2; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_double("-t", argv[++ i], 0, &seconds))
+      {
+        exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    char *end;
+    if (i + 2 >= argc || count == MONITOR_PINS || (pins[count] = get_io_pin(argv[i])) < 0)
+    {
+      fprintf(stderr, "Usage: %s pwm <pin> <frequency> <duty>%% [<pin> <frequency> <duty>%% ...] [-t seconds]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+    frequencies[count] = strtod(argv[i + 1], &end);
+    if (end == argv[i + 1] || *end != '\0')
+    {
+      fprintf(stderr, "Incorrect frequency: %s\n", argv[i + 1]);
+      exit(EXIT_FAILURE);
+    }
+    duties[count] = strtod(argv[i + 2], &end) / 100;
+    if (*end != '%' && *end != '\0')
+    {
+      fprintf(stderr, "Incorrect duty cycle: %s\n", argv[i + 2]);
+      exit(EXIT_FAILURE);
+    }
+    count ++;
+    i += 2;
+  }
+  if (count == 0)
+  {
+    fprintf(stderr, "Usage: %s pwm <pin> <frequency> <duty>%% [<pin> <frequency> <duty>%% ...] [-t seconds]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  bool batched = suspend_register_batch();
+  bool ok = true;
+  for (int i = 0; i < count && ok; i ++)
+  {
+    char * name = (char *)NAMES[pins[i]];
+    ok = set_dir(get_chip_number(name), get_line_number(name), GPIO_OUTPUT) >= 0
+      && pwm_start(pins[i], frequencies[i], duties[i]) >= 0;
+  }
+  if (ok)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_pwm_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    unsigned long long end = get_monotonic_ns() + (unsigned long long)(seconds * 1e9);
+    while (!pwm_interrupted && (seconds <= 0 || get_monotonic_ns() < end))
+    {
+      usleep(10000);
+    }
+    for (int i = 0; i < count; i ++)
+    {
+      PwmChannel stats;
+      if (pwm_get_stats(pins[i], &stats) == 0)
+      {
+        printf("%s: %g Hz %g%%, achieved %.3f Hz over %lu periods (%lu skipped), lateness mean %.1f us, max %.1f us, stddev %.1f us\n",
+          NAMES[pins[i]], frequencies[i], duties[i] * 100, pwm_achieved_frequency(&stats), stats.periods, stats.skipped,
+          stats.lateness.mean / 1000, stats.lateness.max / 1000, running_stats_stddev(&stats.lateness) / 1000);
+      }
+    }
+  }
+  pwm_shutdown();
+  resume_register_batch(batched);
+  if (!ok)
+  {
+    exit(EXIT_FAILURE);
+  }
+}
+
+void print_widths(const char *label, const RunningStats *stats)
+{
+  printf("  %-7s %8lu, min %.1f us, mean %.1f us, max %.1f us, stddev %.1f us\n", label, stats->count,
+    stats->min / 1000, stats->mean / 1000, stats->max / 1000, running_stats_stddev(stats) / 1000);
+}
+
+
+// reflex file lines: <pin> rising/falling/both <pin>=1/0 ...
+int load_reflex_rules(const char *path, ReflexRule *rules, int max)
+{
+  FILE *f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    return -1;
+  }
+  char line[BATCH_LINE_SIZE];
+  int number = 0;
+  int count = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f) != NULL)
+  {
+    number ++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+      *comment = '\0';
+    }
+    char *save;
+    char *pin = strtok_r(line, " \t\r\n", &save);
+    if (pin == NULL)
+    {
+      continue;
+    }
+    if (count == max)
+    {
+      fprintf(stderr, "%s:%d: too many reflex rules (at most %d)\n", path, number, max);
+      ok = false;
+      break;
+    }
+    char *edge = strtok_r(NULL, " \t\r\n", &save);
+    ReflexRule *rule = &rules[count];
+    rule->pin = get_io_pin(pin);
+    rule->edge = (edge == NULL) ? 0 : (strcasecmp(edge, "rising") == 0) ? GPIO_RISING_EDGE
+      : (strcasecmp(edge, "falling") == 0) ? GPIO_FALLING_EDGE : (strcasecmp(edge, "both") == 0) ? GPIO_BOTH_EDGES : 0;
+    ok = (rule->pin > 0 && rule->edge != 0);
+    bank_write_init(&rule->write);
+    int targets = 0;
+    for (char *arg = strtok_r(NULL, " \t\r\n", &save); ok && arg != NULL; arg = strtok_r(NULL, " \t\r\n", &save))
+    {
+      ok = parse_pin_value(arg, &rule->write);
+      targets ++;
+    }
+    ok = ok && targets > 0;
+    if (!ok)
+    {
+      fprintf(stderr, "%s:%d: incorrect reflex rule\n", path, number);
+    }
+    count ++;
+  }
+  if (f != stdin)
+  {
+    fclose(f);
+  }
+  return ok ? count : -1;
+}
+
+
+void print_reflex(int pin, int edge)
+{
+  ReflexAction action;
+  if (reflex_get_action(pin, edge, &action) == 0)
+  {
+    printf("%s %-7s %8lu edges (%lu failed), latency min %.1f us, mean %.1f us, max %.1f us, stddev %.1f us\n", NAMES[pin],
+      edge == GPIO_RISING_EDGE ? "rising" : "falling", action.fired, action.failed, action.latency.min / 1000,
+      action.latency.mean / 1000, action.latency.max / 1000, running_stats_stddev(&action.latency) / 1000);
+  }
+}
+
+
+volatile sig_atomic_t reflex_interrupted = 0;
+
+
+void on_reflex_signal(int sig)
+{
+  reflex_interrupted = 1;
+}
+
+
+// vgp reflex <file> [-t seconds]
+void do_reflex(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s reflex <rules file> [-t seconds]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  double seconds = 0;
+  for (int i = 3; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_double("-t", argv[++ i], 0, &seconds))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  ReflexRule rules[REFLEX_MAX_RULES];
+  int count = load_reflex_rules(argv[2], rules, REFLEX_MAX_RULES);
+  bool batched = suspend_register_batch();
+  if (count <= 0 || reflex_load(rules, count) < 0)
+  {
+    resume_register_batch(batched);
+    exit(EXIT_FAILURE);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_reflex_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  unsigned long long end = get_monotonic_ns() + (unsigned long long)(seconds * 1e9);
+  while (!reflex_interrupted && (seconds <= 0 || get_monotonic_ns() < end))
+  {
+    usleep(10000);
+  }
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    print_reflex(pin, GPIO_RISING_EDGE);
+    print_reflex(pin, GPIO_FALLING_EDGE);
+  }
+  reflex_unload();
+  stop_monitor();
+  resume_register_batch(batched);
+}
+
+
+// vgp freq/pulse <pin> [-w window_ms] [-n windows] [-d settle_us]
+void do_measure(int argc, char *const *argv, bool pulse)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s %s <pin> [-w window_ms] [-n windows] [-d settle_us]\n", argv[0], argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  int pin = get_io_pin(argv[2]);
+  if (pin < 0)
+  {
+    fprintf(stderr, "Incorrect pin: %s\n", argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  int window = 1000;
+  int windows = 1;
+  int settle = 0;
+  for (int i = 3; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-w", argv[++ i], 1, &window))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-n", argv[++ i], 0, &windows))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+    {
+      if (!parse_option_int("-d", argv[++ i], 1, &settle))
+      {
+        exit(EXIT_FAILURE);
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Incorrect option: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  EdgeWaiter waiter;
+  if (edge_waiter_open(&waiter, pin, GPIO_BOTH_EDGES) < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  if (settle > 0 && edge_waiter_set_debounce(&waiter, settle) < 0)
+  {
+    edge_waiter_close(&waiter);
+    exit(EXIT_FAILURE);
+  }
+  PulseMeter meter;
+  pulse_meter_init(&meter);
+  unsigned long long end = get_monotonic_ns() + window * 1000000ULL;
+  // -n 0 measures until interrupted
+  for (int n = 0; windows == 0 || n < windows; )
+  {
+    unsigned long long now = get_monotonic_ns();
+    EdgeEvent event;
+    int ret = (now >= end) ? 0 : edge_waiter_wait(&waiter, (end - now + 999999) / 1000000, &event);
+    if (ret < 0)
+    {
+      edge_waiter_close(&waiter);
+      exit(EXIT_FAILURE);
+    }
+    if (ret > 0)
+    {
+      pulse_meter_feed(&meter, event.edge, event.timestamp);
+      continue;
+    }
+    if (get_monotonic_ns() < end)
+    {
+      continue;
+    }
+    if (!pulse)
+    {
+      printf("%s: %.3f Hz, %lu edges\n", NAMES[pin], pulse_meter_frequency(&meter), meter.edges);
+      print_widths("period", &meter.period);
+    }
+    else
+    {
+      printf("%s: duty %.2f%%, %lu edges\n", NAMES[pin], pulse_meter_duty(&meter) * 100, meter.edges);
+      print_widths("high", &meter.high);
+      print_widths("low", &meter.low);
+    }
+    fflush(stdout);
+    pulse_meter_next_window(&meter);
+    end += window * 1000000ULL;
+    n ++;
+  }
+  edge_waiter_close(&waiter);
+}
+
+void do_version(int argc, char *const *argv)
+{
+   printf("Vivid GPIO utility version: %.2f\n", VGP_VERSION);
+}
+
+// vgp command parameters...
+// vpg help
+// vgp list
+// vgp all
+// vgp save <file>
+// vgp apply <file> [-v]
+// vgp mode 4C2
+// vgp mode 4C2 in/out
+// vgp alt 4C2
+// vgp alt 4C2 0/1/2/3
+// vgp get 4C2
+// vgp set 4C2 0
+// vgp set 4C2=1 4D6=0 ...
+// vgp wfi 4C2 rising/falling/both [-t timeout_ms] [-n count] [-d settle_us] [-v]
+// vgp adc 0/3/4 [v/V]
+// vgp adc stream 0,3,4 [-r rate] [-n frames] [-T trigger] [-f file] [-o file] [-F filter] [v]
+// vgp adcwatch 0/3/4 above/below <level> | outside/inside <low> <high> [-H hysteresis] [-d dwell_ms] [-r rate] [-t timeout_ms] [-n count] [-e] [-v]
+// vgp bus 2A0,2A1,... [value]
+// vgp capture 2A0,2A1,... [-e] [-T pin=edge] [-p pre_us] [-d post_us] [-t timeout_ms] [-n samples] [-o vcd] [-b bin]
+// vgp play <file> [-l loops] [-v]
+// vgp pwm <pin> <frequency> <duty>% [<pin> <frequency> <duty>% ...] [-t seconds]
+// vgp reflex <file> [-t seconds]
+// vgp freq <pin> [-w window_ms] [-n windows] [-d settle_us]
+// vgp pulse <pin> [-w window_ms] [-n windows] [-d settle_us]
+
+void run_command_line(int argc, char *const *argv)
+{
+  // single pin commands go through vgpd when it is running
+  const char *client_commands[] = { "mode", "alt", "get", "set", "adc" };
+  for (int i = 0; i < sizeof(client_commands) / sizeof(client_commands[0]); i ++)
+  {
+    if (strcasecmp(argv[1], client_commands[i]) == 0)
+    {
+      vgpd_attach();
+    }
+  }
+  if (strcasecmp(argv[1], "all") == 0)
+  {
+    do_all();
   }
   else if (strcasecmp(argv[1], "list") == 0)
   {
     do_list();
   }
+  else if (strcasecmp(argv[1], "save") == 0)
+  {
+    do_save(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "apply") == 0)
+  {
+    do_apply(argc, argv);
+  }
   else if (strcasecmp(argv[1], "mode") == 0)
   {
     do_mode(argc, argv);
@@ -577,6 +2043,38 @@ int main(int argc, char *const *argv)
   {
     do_adc(argc, argv);
   }
+  else if (strcasecmp(argv[1], "adcwatch") == 0)
+  {
+    do_adcwatch(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "bus") == 0)
+  {
+    do_bus(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "capture") == 0)
+  {
+    do_capture(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "play") == 0)
+  {
+    do_play(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "pwm") == 0)
+  {
+    do_pwm(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "reflex") == 0)
+  {
+    do_reflex(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "freq") == 0)
+  {
+    do_measure(argc, argv, false);
+  }
+  else if (strcasecmp(argv[1], "pulse") == 0)
+  {
+    do_measure(argc, argv, true);
+  }
   else if (strcasecmp(argv[1], "-h") == 0 || strcasecmp(argv[1], "--help") == 0 || strcasecmp(argv[1], "help") == 0)
   {
     do_help(argc, argv);
@@ -585,4 +2083,179 @@ int main(int argc, char *const *argv)
   {
     do_version(argc, argv);
   }
-}
\ No newline at end of file
+  else
+  {
+    fprintf(stderr, "Unknown command: %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+// runs the ';' separated commands in the line, returns false if none was found
+bool run_script_line(const char *program, char *line)
+{
+  bool found = false;
+  char *saveptr;
+  for (char *command = strtok_r(line, ";\n", &saveptr); command != NULL; command = strtok_r(NULL, ";\n", &saveptr))
+  {
+    char *args[BATCH_MAX_ARGS + 1];
+    int count = 0;
+    args[count ++] = (char *)program;
+    char *argptr;
+    for (char *arg = strtok_r(command, " \t\r", &argptr); arg != NULL; arg = strtok_r(NULL, " \t\r", &argptr))
+    {
+      if (arg[0] == '#')
+      {
+        break;  // comment till the end of the command
+      }
+      if (count == BATCH_MAX_ARGS)
+      {
+        fprintf(stderr, "Too many arguments in command \"%s ...\" (at most %d)\n", args[1], BATCH_MAX_ARGS - 1);
+        exit(EXIT_FAILURE);
+      }
+      args[count ++] = arg;
+    }
+    args[count] = NULL;
+    if (count < 2)
+    {
+      continue;
+    }
+    if (strcasecmp(args[1], "batch") == 0 || strcmp(args[1], "-c") == 0)
+    {
+      fprintf(stderr, "%s can not be nested\n", args[1]);
+      exit(EXIT_FAILURE);
+    }
+    run_command_line(count, args);
+    found = true;
+  }
+  return found;
+}
+
+
+void do_batch(int argc, char *const *argv)
+{
+  FILE *fp = stdin;
+  if (argc >= 3 && strcmp(argv[2], "-") != 0)
+  {
+    fp = fopen(argv[2], "r");
+    if (fp == NULL)
+    {
+      perror("Can not open batch file");
+      exit(EXIT_FAILURE);
+    }
+  }
+  char line[BATCH_LINE_SIZE];
+  begin_register_batch();
+  for (int n = 1; fgets(line, BATCH_LINE_SIZE, fp) != NULL; n ++)
+  {
+    if (strchr(line, '\n') == NULL && !feof(fp))
+    {
+      fprintf(stderr, "Line %d is too long (at most %d characters)\n", n, BATCH_LINE_SIZE - 2);
+      exit(EXIT_FAILURE);
+    }
+    run_script_line(argv[0], line);
+  }
+  end_register_batch();
+  if (fp != stdin)
+  {
+    fclose(fp);
+  }
+}
+
+
+void do_commands(int argc, char *const *argv)
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s -c \"<command>; <command>; ...\"\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (strlen(argv[2]) >= BATCH_LINE_SIZE)
+  {
+    fprintf(stderr, "Commands are too long (at most %d characters)\n", BATCH_LINE_SIZE - 1);
+    exit(EXIT_FAILURE);
+  }
+  char line[BATCH_LINE_SIZE];
+  strcpy(line, argv[2]);
+  begin_register_batch();
+  run_script_line(argv[0], line);
+  end_register_batch();
+}
+
+
+bool stats_json = false;
+
+
+void print_op_stats()
+{
+  fflush(stdout);
+  write_op_stats(stderr, stats_json);
+}
+
+
+// vgp stats [-j] <command> ...: runs the command, then prints the statistics to stderr
+void do_stats(int argc, char *const *argv)
+{
+  int first = 2;
+  if (argc > first && strcmp(argv[first], "-j") == 0)
+  {
+    stats_json = true;
+    first ++;
+  }
+  if (argc <= first)
+  {
+    fprintf(stderr, "Usage: %s stats [-j] <command> <parameter> ...\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  // also printed when the command exits with an error
+  atexit(print_op_stats);
+  // the command keeps all of its arguments, only the "stats [-j]" is dropped
+  char *args[argc + 1];
+  int count = 0;
+  args[count ++] = argv[0];
+  for (int i = first; i < argc; i ++)
+  {
+    args[count ++] = argv[i];
+  }
+  args[count] = NULL;
+  if (strcasecmp(args[1], "batch") == 0)
+  {
+    do_batch(count, args);
+  }
+  else if (strcmp(args[1], "-c") == 0)
+  {
+    do_commands(count, args);
+  }
+  else
+  {
+    run_command_line(count, args);
+  }
+}
+
+
+int main(int argc, char *const *argv)
+{
+  if (argc == 1)
+  {
+    fprintf(stderr, "Usage: %s <command> <pin> <parameter> ...\n", argv[0]);
+    fprintf(stderr, "Run \"%s --help\" for more information.\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (strcasecmp(argv[1], "batch") == 0)
+  {
+    do_batch(argc, argv);
+  }
+  else if (strcmp(argv[1], "-c") == 0)
+  {
+    do_commands(argc, argv);
+  }
+  else if (strcasecmp(argv[1], "stats") == 0)
+  {
+    do_stats(argc, argv);
+  }
+  else
+  {
+    run_command_line(argc, argv);
+  }
+  return 0;
+}
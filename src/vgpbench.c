@@ -0,0 +1,674 @@
+#include <gpiod.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "vgplib.h"
+
+
+#define DEFAULT_PIN         "4D6"
+#define DEFAULT_ITERATIONS  10000
+#define DEFAULT_FILTER_SAMPLES  (1 << 24)
+#define DEFAULT_SUITE_ITERATIONS  100000
+#define SUITE_MAX_RESULTS  16
+#define SUITE_EDGES        2000      // edges per gpio-sim benchmark, each takes a sysfs write
+#define EDGE_TIMEOUT_MS    1000
+
+// gpio-sim device made by the suite, with five 32 line banks like the RK3399
+#define GPIO_SIM_CONFIGFS  "/sys/kernel/config/gpio-sim"
+#define GPIO_SIM_NAME      "vgpbench"
+#define EDGE_PIN           13        // 2D3, bank 2 line 27
+
+// 8 bit bus on banks 2 and 4: 2A0, 2A1, 2A4, 2A6, 4D6, 4D2, 4B0, 4B1
+static const int BUS_PINS[] = { 3, 5, 15, 16, 11, 12, 37, 38 };
+
+
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// run get() or set() on the pin and return calls per second
+double bench_get_set(int ch, int ln, bool write, int iterations)
+{
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i ++)
+  {
+    int ret = write ? set(ch, ln, i & 0x01) : get(ch, ln);
+    if (ret < 0)
+    {
+      fprintf(stderr, "%s returned %d\n", write ? "set" : "get", ret);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return iterations / (now_seconds() - start);
+}
+
+
+// bus_write() or bus_read() in a loop, returns words per second
+double bench_bus(const Bus *bus, bool write, int iterations)
+{
+  unsigned int word;
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i ++)
+  {
+    int ret = write ? bus_write(bus, i & 0xff) : bus_read(bus, &word);
+    if (ret < 0)
+    {
+      fprintf(stderr, "%s returned %d\n", write ? "bus_write" : "bus_read", ret);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return iterations / (now_seconds() - start);
+}
+
+
+void report_bus(const char *name, const char *backend, double rate)
+{
+  printf("%-10s %-6s %12.0f words/s %10.3f us/word\n", name, backend, rate, 1e6 / rate);
+}
+
+
+// runs the bus benchmark on the simulator and on mapped registers (or VGP_MEM_FILE)
+int main_bus(int iterations)
+{
+  Bus bus;
+  if (bus_init(&bus, "bench", BUS_PINS, sizeof(BUS_PINS) / sizeof(BUS_PINS[0])) < 0)
+  {
+    return EXIT_FAILURE;
+  }
+  printf("Benchmarking an 8 bit bus with %d iterations\n", iterations);
+  const int backends[] = { REGISTER_BACKEND_SIM, REGISTER_BACKEND_MEM };
+  for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i ++)
+  {
+    if (set_register_backend(backends[i]) != backends[i])
+    {
+      printf("%s backend not available, skipped\n", i == 0 ? "sim" : "mem");
+      continue;
+    }
+    reset_register_stats();
+    report_bus("bus_write", get_register_ops()->name, bench_bus(&bus, true, iterations));
+    report_bus("bus_read", get_register_ops()->name, bench_bus(&bus, false, iterations));
+    RegisterStats stats;
+    get_register_stats(&stats);
+    printf("%-10s %-6s %12.2f accesses/word\n", "", get_register_ops()->name,
+      (double)(stats.reads + stats.writes) / (2 * iterations));
+  }
+  close_register_backend();
+  return 0;
+}
+
+
+// runs one ADC filter over a synthetic block again and again, returns input samples per second
+double bench_filter(const char *spec, const int *raw, float *out, int samples)
+{
+  AdcFilter filter;
+  if (adc_filter_init(&filter, spec, 10000) < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  double start = now_seconds();
+  for (int done = 0; done < samples; done += ADC_FILTER_BLOCK)
+  {
+    adc_filter_process(&filter, raw, out, ADC_FILTER_BLOCK);
+  }
+  return samples / (now_seconds() - start);
+}
+
+
+void report_filter(const char *name, double rate)
+{
+  printf("%-12s %14.0f samples/s %10.3f ns/sample\n", name, rate, 1e9 / rate);
+}
+
+
+// single threaded, so the rates are per core
+int main_filters(int samples)
+{
+  int raw[ADC_FILTER_BLOCK];
+  float counts[ADC_FILTER_BLOCK], volts[ADC_FILTER_BLOCK];
+  for (int i = 0; i < ADC_FILTER_BLOCK; i ++)
+  {
+    raw[i] = (i * 37 + (i >> 3)) & 0x3ff;
+  }
+  printf("Benchmarking ADC filters with %d samples per filter\n", samples);
+  float scale = get_adc_scale();
+  double start = now_seconds();
+  for (int done = 0; done < samples; done += ADC_FILTER_BLOCK)
+  {
+    adc_to_volts(raw, volts, ADC_FILTER_BLOCK, scale);
+  }
+  report_filter("adc_to_volts", samples / (now_seconds() - start));
+  report_filter("boxcar:16", bench_filter("boxcar:16", raw, counts, samples));
+  report_filter("boxcar:256", bench_filter("boxcar:256", raw, counts, samples));
+  report_filter("iir:100", bench_filter("iir:100", raw, counts, samples));
+  report_filter("cic:16:3", bench_filter("cic:16:3", raw, counts, samples));
+  // keeps the compiler from dropping the conversion loop
+  return (volts[0] < 0) ? EXIT_FAILURE : 0;
+}
+
+
+// Benchmark suite: every primitive is timed call by call, so that the
+// percentiles can be reported next to the rate
+
+typedef struct {
+  const char *name;
+  const char *backend;
+  int count;
+  double ops_per_second;
+  unsigned long long p50;
+  unsigned long long p90;
+  unsigned long long p99;
+  unsigned long long max;
+} BenchResult;
+
+BenchResult suite_results[SUITE_MAX_RESULTS];
+
+int suite_count = 0;
+
+const char *suite_skipped[SUITE_MAX_RESULTS];
+
+int skipped_count = 0;
+
+
+int compare_ns(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+
+// sorts the samples and adds a result, elapsed is the time of the whole run
+void add_result(const char *name, const char *backend, unsigned long long *samples, int count, double elapsed)
+{
+  qsort(samples, count, sizeof(samples[0]), compare_ns);
+  BenchResult *r = &suite_results[suite_count ++];
+  r->name = name;
+  r->backend = backend;
+  r->count = count;
+  r->ops_per_second = count / elapsed;
+  r->p50 = samples[(count - 1) / 2];
+  r->p90 = samples[(int)((count - 1) * 0.9)];
+  r->p99 = samples[(int)((count - 1) * 0.99)];
+  r->max = samples[count - 1];
+  printf("%-15s %-8s %12.0f ops/s %10llu %10llu %10llu %10llu\n", r->name, r->backend, r->ops_per_second, r->p50, r->p90,
+    r->p99, r->max);
+}
+
+
+typedef int (*BenchOp)(int i);
+
+int op_register_read(int i)
+{
+  unsigned int value;
+  return read_register(GPIO_BASE[4] + GPIO_SWPORTA_DR, &value);
+}
+
+int op_register_write(int i)
+{
+  return write_register(GPIO_BASE[4] + GPIO_SWPORTA_DR, i & 0x01);
+}
+
+int op_get(int i)
+{
+  return get(4, 30);
+}
+
+int op_set(int i)
+{
+  return set(4, 30, i & 0x01);
+}
+
+int op_mode(int i)
+{
+  return set_dir(4, 26, i & 0x01);
+}
+
+int op_alt(int i)
+{
+  return set_alt(2, 0, i & 0x01);
+}
+
+int op_snapshot(int i)
+{
+  BoardSnapshot snapshot;
+  return read_board_snapshot(&snapshot);
+}
+
+int op_adc(int i)
+{
+  const int channels[] = { 0, 3, 4 };
+  return get_adc(channels[i % 3]);
+}
+
+
+// runs a tenth of the iterations untimed first, then times each call
+void bench_op(const char *name, const char *backend, BenchOp op, int iterations)
+{
+  unsigned long long *samples = malloc(iterations * sizeof(unsigned long long));
+  if (samples == NULL)
+  {
+    perror("Can not allocate samples");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < iterations / 10; i ++)
+  {
+    op(i);
+  }
+  double start = now_seconds();
+  for (int i = 0; i < iterations; i ++)
+  {
+    unsigned long long t0 = stats_clock_ns();
+    if (op(i) < 0)
+    {
+      fprintf(stderr, "%s failed\n", name);
+      exit(EXIT_FAILURE);
+    }
+    samples[i] = stats_clock_ns() - t0;
+  }
+  add_result(name, backend, samples, iterations, now_seconds() - start);
+  free(samples);
+}
+
+
+int write_file(const char *dir, const char *name, const char *value)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  int ret = (write(fd, value, strlen(value)) == strlen(value)) ? 0 : -1;
+  close(fd);
+  return ret;
+}
+
+
+int read_file(const char *dir, const char *name, char *value, int size)
+{
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  int n = read(fd, value, size - 1);
+  close(fd);
+  if (n <= 0)
+  {
+    return -1;
+  }
+  value[n] = '\0';
+  value[strcspn(value, "\n")] = '\0';
+  return n;
+}
+
+
+// ADC reads against a fake IIO device in a temporary directory, so that the
+// numbers do not depend on the board
+void bench_adc(int iterations)
+{
+  char root[] = "/tmp/vgpbench-iio-XXXXXX";
+  char device[64];
+  if (mkdtemp(root) == NULL)
+  {
+    perror("Can not create the IIO directory");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(device, sizeof(device), "%s/iio:device0", root);
+  mkdir(device, 0755);
+  const char *files[] = { "in_voltage0_raw", "in_voltage3_raw", "in_voltage4_raw" };
+  write_file(device, "name", "ff100000.saradc\n");
+  for (int i = 0; i < 3; i ++)
+  {
+    write_file(device, files[i], "512\n");
+  }
+  setenv("VGP_IIO_DEVICES", root, 1);
+  bench_op("adc", "sysfs", op_adc, iterations);
+  close_adc();
+  char path[128];
+  const char *all[] = { "name", "in_voltage0_raw", "in_voltage3_raw", "in_voltage4_raw" };
+  for (int i = 0; i < 4; i ++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", device, all[i]);
+    unlink(path);
+  }
+  rmdir(device);
+  rmdir(root);
+}
+
+
+// creates the gpio-sim device, returns the number of its first gpiochip or -1
+int gpio_sim_setup(char *pull_path, int size)
+{
+  char dir[128];
+  char bank[160];
+  char value[64];
+  snprintf(dir, sizeof(dir), "%s/%s", GPIO_SIM_CONFIGFS, GPIO_SIM_NAME);
+  if (mkdir(dir, 0755) < 0)
+  {
+    return -1;
+  }
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    snprintf(bank, sizeof(bank), "%s/bank%d", dir, ch);
+    if (mkdir(bank, 0755) < 0 || write_file(bank, "num_lines", "32") < 0)
+    {
+      return -1;
+    }
+  }
+  if (write_file(dir, "live", "1") < 0)
+  {
+    return -1;
+  }
+  // the banks are registered one after another, the base must line up
+  int base = -1;
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    snprintf(bank, sizeof(bank), "%s/bank%d", dir, ch);
+    if (read_file(bank, "chip_name", value, sizeof(value)) < 0 || strncmp(value, "gpiochip", 8) != 0)
+    {
+      return -1;
+    }
+    int number = atoi(value + 8);
+    if (ch == 0)
+    {
+      base = number;
+    }
+    else if (number != base + ch)
+    {
+      fprintf(stderr, "gpio-sim banks are not consecutive gpiochips\n");
+      return -1;
+    }
+  }
+  char device[64];
+  if (read_file(dir, "dev_name", device, sizeof(device)) < 0)
+  {
+    return -1;
+  }
+  char *pin_name = (char *)NAMES[EDGE_PIN];
+  snprintf(pull_path, size, "/sys/devices/platform/%s/gpiochip%d/sim_gpio%d/pull", device,
+    base + get_chip_number(pin_name), get_line_number(pin_name));
+  return base;
+}
+
+
+void gpio_sim_teardown()
+{
+  char dir[128];
+  char bank[160];
+  snprintf(dir, sizeof(dir), "%s/%s", GPIO_SIM_CONFIGFS, GPIO_SIM_NAME);
+  write_file(dir, "live", "0");
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    snprintf(bank, sizeof(bank), "%s/bank%d", dir, ch);
+    rmdir(bank);
+  }
+  rmdir(dir);
+}
+
+
+int edge_event_fd = -1;
+
+unsigned long long edge_received_ns = 0;
+
+unsigned long long edge_timestamp_ns = 0;
+
+unsigned long edge_count = 0;
+
+unsigned long long edge_last_ns = 0;
+
+
+// leaves no gpio-sim device behind when an edge benchmark fails
+void edge_bench_failed(const char *message)
+{
+  fprintf(stderr, "%s\n", message);
+  stop_monitor();
+  gpio_sim_teardown();
+  exit(EXIT_FAILURE);
+}
+
+
+void on_bench_edge(void *p)
+{
+  MonitorPin *mp = (MonitorPin *)p;
+  // runs on the monitor thread, the count is read while edges come in
+  edge_received_ns = get_monotonic_ns();
+  edge_timestamp_ns = mp->latest_timestamp;
+  __atomic_store_n(&edge_last_ns, edge_received_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&edge_count, 1, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write(edge_event_fd, &one, sizeof(one)) < 0)
+  {
+    perror("Error signalling edge");
+  }
+}
+
+
+// delivery through the monitor thread: from the pull write to the callback,
+// and from the kernel timestamp to the callback; then edges per second
+void bench_edges()
+{
+  char pull_path[256];
+  int base = gpio_sim_setup(pull_path, sizeof(pull_path));
+  int pull_fd = (base < 0) ? -1 : open(pull_path, O_WRONLY);
+  if (pull_fd < 0)
+  {
+    printf("gpio-sim is not available (needs root and the gpio-sim module), edge benchmarks skipped\n");
+    suite_skipped[skipped_count ++] = "edge_latency";
+    suite_skipped[skipped_count ++] = "edge_dispatch";
+    suite_skipped[skipped_count ++] = "edge_throughput";
+    gpio_sim_teardown();
+    return;
+  }
+  char env[16];
+  snprintf(env, sizeof(env), "%d", base);
+  setenv("VGP_GPIOCHIP_BASE", env, 1);
+  edge_event_fd = eventfd(0, EFD_CLOEXEC);
+  if (monitor_add_pin(EDGE_PIN, GPIO_BOTH_EDGES, on_bench_edge) < 0)
+  {
+    edge_bench_failed("Can not monitor the gpio-sim line");
+  }
+  unsigned long long *latency = malloc(SUITE_EDGES * sizeof(unsigned long long));
+  unsigned long long *dispatch = malloc(SUITE_EDGES * sizeof(unsigned long long));
+  int level = 0;
+  double start = now_seconds();
+  for (int i = 0; i < SUITE_EDGES; i ++)
+  {
+    level = !level;
+    const char *pull = level ? "pull-up" : "pull-down";
+    unsigned long long t0 = get_monotonic_ns();
+    struct pollfd pfd = { edge_event_fd, POLLIN, 0 };
+    uint64_t count;
+    if (pwrite(pull_fd, pull, strlen(pull), 0) < 0 || poll(&pfd, 1, EDGE_TIMEOUT_MS) <= 0
+      || read(edge_event_fd, &count, sizeof(count)) < 0)
+    {
+      edge_bench_failed("No edge from gpio-sim");
+    }
+    latency[i] = edge_received_ns - t0;
+    dispatch[i] = edge_received_ns - edge_timestamp_ns;
+  }
+  double elapsed = now_seconds() - start;
+  add_result("edge_latency", "gpio-sim", latency, SUITE_EDGES, elapsed);
+  add_result("edge_dispatch", "gpio-sim", dispatch, SUITE_EDGES, elapsed);
+
+  // as fast as the pull can be toggled, without waiting for the callback;
+  // the clock stops at the callback of the last edge
+  unsigned long first = __atomic_load_n(&edge_count, __ATOMIC_ACQUIRE);
+  unsigned long long start_ns = get_monotonic_ns();
+  for (int i = 0; i < SUITE_EDGES; i ++)
+  {
+    level = !level;
+    const char *pull = level ? "pull-up" : "pull-down";
+    if (pwrite(pull_fd, pull, strlen(pull), 0) < 0)
+    {
+      edge_bench_failed("Can not set the gpio-sim pull");
+    }
+  }
+  unsigned long long give_up = get_monotonic_ns() + EDGE_TIMEOUT_MS * 1000000ULL;
+  unsigned long delivered;
+  while ((delivered = __atomic_load_n(&edge_count, __ATOMIC_ACQUIRE) - first) < SUITE_EDGES && get_monotonic_ns() < give_up)
+  {
+    usleep(100);
+  }
+  unsigned long long end_ns = __atomic_load_n(&edge_last_ns, __ATOMIC_RELAXED);
+  BenchResult *r = &suite_results[suite_count ++];
+  memset(r, 0, sizeof(BenchResult));
+  r->name = "edge_throughput";
+  r->backend = "gpio-sim";
+  r->count = delivered;
+  r->ops_per_second = (delivered > 0 && end_ns > start_ns) ? delivered / ((end_ns - start_ns) / 1e9) : 0;
+  printf("%-15s %-8s %12.0f edges/s (%d of %d edges delivered)\n", r->name, r->backend, r->ops_per_second, r->count,
+    SUITE_EDGES);
+
+  stop_monitor();
+  close(pull_fd);
+  close(edge_event_fd);
+  free(latency);
+  free(dispatch);
+  gpio_sim_teardown();
+}
+
+
+void write_suite_json(FILE *f, const char *label, int iterations)
+{
+  struct utsname host;
+  uname(&host);
+  fprintf(f, "{\n  \"label\": \"%s\",\n  \"host\": {\"sysname\": \"%s\", \"release\": \"%s\", \"machine\": \"%s\"},\n",
+    label, host.sysname, host.release, host.machine);
+  fprintf(f, "  \"iterations\": %d,\n  \"results\": [", iterations);
+  for (int i = 0; i < suite_count; i ++)
+  {
+    const BenchResult *r = &suite_results[i];
+    fprintf(f, "%s\n    {\"name\": \"%s\", \"backend\": \"%s\", \"count\": %d, \"ops_per_second\": %.1f, \"p50_ns\": %llu, "
+      "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}", i == 0 ? "" : ",", r->name, r->backend, r->count,
+      r->ops_per_second, r->p50, r->p90, r->p99, r->max);
+  }
+  fprintf(f, "\n  ],\n  \"skipped\": [");
+  for (int i = 0; i < skipped_count; i ++)
+  {
+    fprintf(f, "%s\"%s\"", i == 0 ? "" : ", ", suite_skipped[i]);
+  }
+  fprintf(f, "]\n}\n");
+}
+
+
+// vgpbench suite [iterations] [-j file] [-l label]
+int main_suite(int argc, char *const *argv)
+{
+  int iterations = DEFAULT_SUITE_ITERATIONS;
+  const char *json = NULL;
+  const char *label = "";
+  for (int i = 2; i < argc; i ++)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+    {
+      json = argv[++ i];
+    }
+    else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+    {
+      label = argv[++ i];
+    }
+    else if ((iterations = atoi(argv[i])) <= 0)
+    {
+      fprintf(stderr, "Usage: %s suite [iterations] [-j file] [-l label]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  // every run starts from the same simulated board
+  if (set_register_backend(REGISTER_BACKEND_SIM) != REGISTER_BACKEND_SIM)
+  {
+    fprintf(stderr, "sim backend not available\n");
+    return EXIT_FAILURE;
+  }
+  set_dir(4, 30, GPIO_OUTPUT);
+  printf("Benchmark suite, %d iterations per primitive (times in ns)\n", iterations);
+  printf("%-15s %-8s %18s %10s %10s %10s %10s\n", "primitive", "backend", "rate", "p50", "p90", "p99", "max");
+  bench_op("register_read", "sim", op_register_read, iterations);
+  bench_op("register_write", "sim", op_register_write, iterations);
+  bench_op("get", "sim", op_get, iterations);
+  bench_op("set", "sim", op_set, iterations);
+  bench_op("mode", "sim", op_mode, iterations);
+  bench_op("alt", "sim", op_alt, iterations);
+  bench_op("snapshot", "sim", op_snapshot, iterations);
+  bench_adc(iterations);
+  bench_edges();
+  close_register_backend();
+
+  if (json != NULL)
+  {
+    FILE *f = (strcmp(json, "-") == 0) ? stdout : fopen(json, "w");
+    if (f == NULL)
+    {
+      perror(json);
+      return EXIT_FAILURE;
+    }
+    write_suite_json(f, label, iterations);
+    if (f != stdout)
+    {
+      fclose(f);
+      printf("Results written to %s\n", json);
+    }
+  }
+  return 0;
+}
+
+
+void report(const char *name, const char *variant, double rate)
+{
+  printf("%-8s %-10s %12.0f calls/s %10.3f us/call\n", name, variant, rate, 1e6 / rate);
+}
+
+
+int main(int argc, char *const *argv)
+{
+  if (argc > 1 && strcmp(argv[1], "suite") == 0)
+  {
+    return main_suite(argc, argv);
+  }
+  const char *pin = (argc > 1) ? argv[1] : DEFAULT_PIN;
+  int iterations = (argc > 2) ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+  if (strcmp(pin, "bus") == 0 && iterations > 0)
+  {
+    return main_bus(iterations);
+  }
+  if (strcmp(pin, "filters") == 0 && iterations > 0)
+  {
+    return main_filters((argc > 2) ? iterations : DEFAULT_FILTER_SAMPLES);
+  }
+  if (strlen(pin) != 3 || iterations <= 0)
+  {
+    fprintf(stderr, "Usage: %s [pin] [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s bus [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s filters [samples]\n", argv[0]);
+    fprintf(stderr, "       %s suite [iterations] [-j file] [-l label]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int ch = get_chip_number((char *)pin);
+  int ln = get_line_number((char *)pin);
+
+  printf("Benchmarking %s with %d iterations (register backend: %s)\n", pin, iterations, get_register_ops()->name);
+
+  set_line_cache_enabled(false);
+  report("get", "uncached", bench_get_set(ch, ln, false, iterations));
+  report("set", "uncached", bench_get_set(ch, ln, true, iterations));
+
+  set_line_cache_enabled(true);
+  report("get", "cached", bench_get_set(ch, ln, false, iterations));
+  report("set", "cached", bench_get_set(ch, ln, true, iterations));
+  return 0;
+}
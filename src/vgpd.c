@@ -0,0 +1,330 @@
+#include <gpiod.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "vgplib.h"
+
+
+#define MAX_CLIENTS   32
+#define LISTEN_ID     0xffffffff
+#define EVENTS_ID     0xfffffffe
+
+typedef struct {
+  int fd;
+  int edges[MONITOR_PINS];  // subscribed edges per physical pin
+} Client;
+
+Client clients[MAX_CLIENTS];
+
+int epoll_fd;
+
+int event_fd;
+
+EventReader event_reader;
+
+volatile sig_atomic_t running = 1;
+
+
+void on_signal(int sig)
+{
+  running = 0;
+}
+
+
+void on_pin_event(void *p)
+{
+  // runs on the monitor thread, the main loop reads the ring buffer
+  uint64_t one = 1;
+  if (write(event_fd, &one, sizeof(one)) < 0)
+  {
+    perror("Error signalling event");
+  }
+}
+
+
+int count_subscribers(int pin)
+{
+  int count = 0;
+  for (int i = 0; i < MAX_CLIENTS; i ++)
+  {
+    if (clients[i].fd >= 0 && clients[i].edges[pin] != 0)
+    {
+      count ++;
+    }
+  }
+  return count;
+}
+
+
+int subscribe(Client *client, int pin, int edges)
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin) || edges < 0 || edges > GPIO_BOTH_EDGES)
+  {
+    return -1;
+  }
+  client->edges[pin] = edges;
+  int subscribers = count_subscribers(pin);
+  if (subscribers > 0 && !is_pin_monitored(pin))
+  {
+    if (monitor_add_pin(pin, GPIO_BOTH_EDGES, on_pin_event) < 0)
+    {
+      client->edges[pin] = 0;
+      return -1;
+    }
+  }
+  else if (subscribers == 0 && is_pin_monitored(pin))
+  {
+    monitor_remove_pin(pin);
+  }
+  return 0;
+}
+
+
+void execute(Client *client, VgpdRecord *record)
+{
+  int ch = record->target >> 5;
+  int ln = record->target & 0x1f;
+  if (record->op >= VGPD_OP_GET && record->op <= VGPD_OP_ALT && ch > 4)
+  {
+    record->result = -1;
+    return;
+  }
+  switch (record->op)
+  {
+    case VGPD_OP_GET:
+      record->result = get(ch, ln);
+      break;
+    case VGPD_OP_SET:
+      record->result = set(ch, ln, record->arg);
+      break;
+    case VGPD_OP_MODE:
+      record->result = (record->arg < 0) ? get_dir(ch, ln) : set_dir(ch, ln, record->arg);
+      break;
+    case VGPD_OP_ALT:
+      record->result = (record->arg < 0) ? get_alt(ch, ln) : set_alt(ch, ln, record->arg);
+      break;
+    case VGPD_OP_ADC:
+      record->result = get_adc(record->target);
+      break;
+    case VGPD_OP_SUBSCRIBE:
+      record->result = subscribe(client, record->target, record->arg);
+      break;
+    default:
+      record->result = -1;
+  }
+}
+
+
+void close_client(Client *client)
+{
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  client->fd = -1;
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    if (client->edges[pin] != 0)
+    {
+      subscribe(client, pin, 0);
+    }
+  }
+}
+
+
+void handle_request(Client *client)
+{
+  VgpdFrame frame;
+  ssize_t n = recv(client->fd, &frame, sizeof(frame), 0);
+  if (n <= 0)
+  {
+    close_client(client);
+    return;
+  }
+  if (n < (ssize_t)sizeof(VgpdHeader) || frame.header.magic != VGPD_MAGIC || frame.header.type != VGPD_FRAME_REQUEST
+    || frame.header.count > VGPD_MAX_RECORDS || n != sizeof(VgpdHeader) + frame.header.count * sizeof(VgpdRecord))
+  {
+    fprintf(stderr, "Dropping client with malformed request\n");
+    close_client(client);
+    return;
+  }
+  for (int i = 0; i < frame.header.count; i ++)
+  {
+    execute(client, &frame.records[i]);
+  }
+  frame.header.type = VGPD_FRAME_RESPONSE;
+  if (send(client->fd, &frame, n, MSG_NOSIGNAL) != n)
+  {
+    close_client(client);
+  }
+}
+
+
+void dispatch_events()
+{
+  uint64_t count;
+  if (read(event_fd, &count, sizeof(count)) < 0)
+  {
+    return;
+  }
+  EdgeEvent events[VGPD_MAX_RECORDS];
+  int n;
+  while ((n = event_reader_read(&event_reader, events, VGPD_MAX_RECORDS)) > 0)
+  {
+    for (int i = 0; i < MAX_CLIENTS; i ++)
+    {
+      if (clients[i].fd < 0)
+      {
+        continue;
+      }
+      VgpdFrame frame;
+      frame.header.magic = VGPD_MAGIC;
+      frame.header.type = VGPD_FRAME_EVENT;
+      frame.header.count = 0;
+      frame.header.reserved = 0;
+      for (int j = 0; j < n; j ++)
+      {
+        if (clients[i].edges[events[j].pin] & events[j].edge)
+        {
+          VgpdEvent *ev = &frame.events[frame.header.count ++];
+          ev->pin = events[j].pin;
+          ev->edge = events[j].edge;
+          ev->reserved = 0;
+          ev->sequence = events[j].sequence;
+          ev->timestamp = events[j].timestamp;
+        }
+      }
+      if (frame.header.count > 0)
+      {
+        // never block on a slow subscriber, it loses the frame instead
+        send(clients[i].fd, &frame, sizeof(VgpdHeader) + frame.header.count * sizeof(VgpdEvent), MSG_NOSIGNAL | MSG_DONTWAIT);
+      }
+    }
+  }
+}
+
+
+void accept_client(int listen_fd)
+{
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0)
+  {
+    return;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i ++)
+  {
+    if (clients[i].fd < 0)
+    {
+      memset(&clients[i], 0, sizeof(Client));
+      clients[i].fd = fd;
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u32 = i;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+      return;
+    }
+  }
+  fprintf(stderr, "Too many clients\n");
+  close(fd);
+}
+
+
+int main(int argc, char *const *argv)
+{
+  if (argc > 1)
+  {
+    fprintf(stderr, "Usage: %s\n", argv[0]);
+    fprintf(stderr, "Serves vgp requests on %s (or $VGPD_SOCKET).\n", VGPD_SOCKET_PATH);
+    exit(EXIT_FAILURE);
+  }
+  const char *path = getenv("VGPD_SOCKET");
+  path = (path != NULL) ? path : VGPD_SOCKET_PATH;
+
+  int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, MAX_CLIENTS) < 0)
+  {
+    perror("Can not create vgpd socket");
+    exit(EXIT_FAILURE);
+  }
+  chmod(path, 0660);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  // only deliver the signals while waiting in epoll, not to the monitor thread
+  sigset_t blocked, unblocked;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGINT);
+  sigaddset(&blocked, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &blocked, &unblocked);
+
+  // open the register mappings now rather than on the first request
+  get_register_backend();
+  event_reader_init(&event_reader);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = LISTEN_ID;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  ev.data.u32 = EVENTS_ID;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+  for (int i = 0; i < MAX_CLIENTS; i ++)
+  {
+    clients[i].fd = -1;
+  }
+
+  struct epoll_event ready[MAX_CLIENTS + 2];
+  while (running)
+  {
+    int n = epoll_pwait(epoll_fd, ready, MAX_CLIENTS + 2, -1, &unblocked);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("Error waiting for requests");
+      break;
+    }
+    for (int i = 0; i < n; i ++)
+    {
+      if (ready[i].data.u32 == LISTEN_ID)
+      {
+        accept_client(listen_fd);
+      }
+      else if (ready[i].data.u32 == EVENTS_ID)
+      {
+        dispatch_events();
+      }
+      else if (clients[ready[i].data.u32].fd >= 0)
+      {
+        handle_request(&clients[ready[i].data.u32]);
+      }
+    }
+  }
+
+  stop_monitor();
+  for (int i = 0; i < MAX_CLIENTS; i ++)
+  {
+    if (clients[i].fd >= 0)
+    {
+      close(clients[i].fd);
+    }
+  }
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
@@ -2,7 +2,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <gpiod.h>
 #include "vgplib.h"
 
@@ -13,7 +28,6 @@
 char command_buffer[COMMAND_BUFFER_SIZE];
 char output_buffer[OUTPUT_BUFFER_SIZE];
 
-char chip_name[] = "/dev/gpiochipn";
 
 int run_command(const char * cmd)
 {
@@ -35,335 +49,4626 @@ int run_command(const char * cmd)
 }
 
 
+// Operation statistics. A thread's block is only written by that thread,
+// with relaxed atomics so that readers on other threads see whole values.
+
+static const char * STAT_NAMES[] = { "register_read", "register_write", "get", "set", "mode", "alt", "snapshot", "adc",
+  "edge_dispatch" };
+
+typedef struct StatsBlock {
+  OpStats ops[STAT_OPS];
+  struct StatsBlock * next;
+} StatsBlock;
+
+StatsBlock * stats_blocks = NULL;
+
+__thread StatsBlock * thread_stats_block = NULL;
+
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+unsigned long long stats_clock_ns()
+{
+  // not slewed by NTP, so short intervals are measured in real nanoseconds
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+StatsBlock * get_thread_stats_block()
+{
+  static StatsBlock fallback;
+  if (thread_stats_block == NULL)
+  {
+    // blocks are kept after their thread exits, its counts still add up
+    StatsBlock *block = calloc(1, sizeof(StatsBlock));
+    pthread_mutex_lock(&stats_mutex);
+    if (block == NULL)
+    {
+      block = &fallback;
+    }
+    else
+    {
+      block->next = stats_blocks;
+      stats_blocks = block;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    thread_stats_block = block;
+  }
+  return thread_stats_block;
+}
+
+
+int stats_bucket(unsigned long long ns)
+{
+  if (ns < 8)
+  {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int bucket = (msb << 2) | ((ns >> (msb - 2)) & 0x03);
+  return (bucket < STAT_BUCKETS) ? bucket : STAT_BUCKETS - 1;
+}
+
+
+// the first ns value above the bucket
+unsigned long long op_stats_bucket_limit(int bucket)
+{
+  if (bucket < 8)
+  {
+    return bucket + 1;
+  }
+  int msb = bucket >> 2;
+  return (5ULL + (bucket & 0x03)) << (msb - 2);
+}
+
+
+void stats_record(int op, unsigned long long start)
+{
+  unsigned long long ns = stats_clock_ns() - start;
+  OpStats *stats = &get_thread_stats_block()->ops[op];
+  unsigned long long count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+  if (count == 0 || ns < stats->min_ns)
+  {
+    __atomic_store_n(&stats->min_ns, ns, __ATOMIC_RELAXED);
+  }
+  if (ns > stats->max_ns)
+  {
+    __atomic_store_n(&stats->max_ns, ns, __ATOMIC_RELAXED);
+  }
+  unsigned long long *bucket = &stats->buckets[stats_bucket(ns)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->total_ns, stats->total_ns + ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->count, count + 1, __ATOMIC_RELAXED);
+}
+
+
+bool op_stats_enabled()
+{
+#ifdef VGP_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+// fills STAT_OPS entries with the sums over all threads
+void get_op_stats(OpStats *stats)
+{
+  memset(stats, 0, STAT_OPS * sizeof(OpStats));
+  pthread_mutex_lock(&stats_mutex);
+  for (StatsBlock *block = stats_blocks; block != NULL; block = block->next)
+  {
+    for (int op = 0; op < STAT_OPS; op ++)
+    {
+      const OpStats *from = &block->ops[op];
+      OpStats *to = &stats[op];
+      unsigned long long count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+      if (count == 0)
+      {
+        continue;
+      }
+      unsigned long long min = __atomic_load_n(&from->min_ns, __ATOMIC_RELAXED);
+      unsigned long long max = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+      to->min_ns = (to->count == 0 || min < to->min_ns) ? min : to->min_ns;
+      to->max_ns = (max > to->max_ns) ? max : to->max_ns;
+      to->count += count;
+      to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+      for (int i = 0; i < STAT_BUCKETS; i ++)
+      {
+        to->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+      }
+    }
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+
+// operations running on other threads at the same time may be half counted
+void reset_op_stats()
+{
+  pthread_mutex_lock(&stats_mutex);
+  for (StatsBlock *block = stats_blocks; block != NULL; block = block->next)
+  {
+    for (int op = 0; op < STAT_OPS; op ++)
+    {
+      OpStats *stats = &block->ops[op];
+      __atomic_store_n(&stats->count, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&stats->total_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&stats->min_ns, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&stats->max_ns, 0, __ATOMIC_RELAXED);
+      for (int i = 0; i < STAT_BUCKETS; i ++)
+      {
+        __atomic_store_n(&stats->buckets[i], 0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+
+// upper limit of the bucket holding the fraction of the samples, at most max_ns
+unsigned long long op_stats_percentile(const OpStats *stats, double fraction)
+{
+  unsigned long long target = (unsigned long long)ceil(stats->count * fraction);
+  unsigned long long seen = 0;
+  for (int i = 0; i < STAT_BUCKETS; i ++)
+  {
+    seen += stats->buckets[i];
+    if (seen >= target && seen > 0)
+    {
+      unsigned long long limit = op_stats_bucket_limit(i) - 1;
+      return (limit < stats->max_ns) ? limit : stats->max_ns;
+    }
+  }
+  return stats->max_ns;
+}
+
+
+void write_op_stats(FILE *f, bool json)
+{
+  OpStats stats[STAT_OPS];
+  get_op_stats(stats);
+  if (json)
+  {
+    fprintf(f, "{\"enabled\": %s, \"clock\": \"CLOCK_MONOTONIC_RAW\", \"operations\": {", op_stats_enabled() ? "true" : "false");
+  }
+  else if (!op_stats_enabled())
+  {
+    fprintf(f, "Operation statistics are not compiled in (build with make VGP_STATS=1)\n");
+    return;
+  }
+  else
+  {
+    fprintf(f, "%-15s %10s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "mean ns", "min ns", "p50 ns", "p90 ns",
+      "p99 ns", "max ns");
+  }
+  bool first = true;
+  for (int op = 0; op < STAT_OPS; op ++)
+  {
+    const OpStats *s = &stats[op];
+    if (s->count == 0)
+    {
+      continue;
+    }
+    double mean = (double)s->total_ns / s->count;
+    if (!json)
+    {
+      fprintf(f, "%-15s %10llu %10.0f %10llu %10llu %10llu %10llu %10llu\n", STAT_NAMES[op], s->count, mean, s->min_ns,
+        op_stats_percentile(s, 0.5), op_stats_percentile(s, 0.9), op_stats_percentile(s, 0.99), s->max_ns);
+      continue;
+    }
+    fprintf(f, "%s\n  \"%s\": {\"count\": %llu, \"mean_ns\": %.1f, \"min_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+      "\"p99_ns\": %llu, \"max_ns\": %llu, \"buckets\": [", first ? "" : ",", STAT_NAMES[op], s->count, mean, s->min_ns,
+      op_stats_percentile(s, 0.5), op_stats_percentile(s, 0.9), op_stats_percentile(s, 0.99), s->max_ns);
+    // [upper limit in ns, count] of the buckets that are not empty
+    bool first_bucket = true;
+    for (int i = 0; i < STAT_BUCKETS; i ++)
+    {
+      if (s->buckets[i] != 0)
+      {
+        fprintf(f, "%s[%llu, %llu]", first_bucket ? "" : ", ", op_stats_bucket_limit(i), s->buckets[i]);
+        first_bucket = false;
+      }
+    }
+    fprintf(f, "]}");
+    first = false;
+  }
+  if (json)
+  {
+    fprintf(f, "%s}}\n", first ? "" : "\n");
+  }
+}
+
+
+// Memory windows that cover every register vgplib touches. When mapping
+// /dev/mem the physical base is the file offset, when mapping a fake register
+// file the windows are packed one after another.
+static RegisterWindow register_windows[] = {
+  { 0xff720000, 0x1000, 0x00000, NULL }, // GPIO0
+  { 0xff730000, 0x1000, 0x01000, NULL }, // GPIO1
+  { 0xff780000, 0x1000, 0x02000, NULL }, // GPIO2
+  { 0xff788000, 0x1000, 0x03000, NULL }, // GPIO3
+  { 0xff790000, 0x1000, 0x04000, NULL }, // GPIO4
+  { PMUGRF,     0x1000, 0x05000, NULL }, // PMUGRF
+  { GRF,       0x10000, 0x06000, NULL }, // GRF
+};
+
+#define REGISTER_WINDOWS      (sizeof(register_windows) / sizeof(register_windows[0]))
+#define REGISTER_FILE_SIZE    0x16000
+
+int register_backend = -1;
+
+bool register_file_is_fake = false;
+
+const RegisterBackend * register_ops = NULL;
+
+RegisterStats register_stats;
+
+
+// the backends are used from the PWM, monitor and ADC watch threads too
+void count_register_reads(unsigned long count)
+{
+  __atomic_add_fetch(&register_stats.reads, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&register_stats.bytes_read, count * 4, __ATOMIC_RELAXED);
+}
+
+
+void count_register_writes(unsigned long count)
+{
+  __atomic_add_fetch(&register_stats.writes, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&register_stats.bytes_written, count * 4, __ATOMIC_RELAXED);
+}
+
+
+// "sudo io" backend
+
+int io_open()
+{
+  return 0;
+}
+
+
+void io_close()
+{
+}
+
+
+int io_read32(unsigned int address, unsigned int *value)
+{
+  sprintf(command_buffer, "sudo io -4 -r 0x%x", address);
+  int length = run_command(command_buffer);
+  if (length < 12)
+  {
+    printf("get_register returned an error\n");
+    return -1;
+  }
+  *value = strtoul(&output_buffer[11], NULL, 16);
+  count_register_reads(1);
+  return 0;
+}
+
+
+int io_write32(unsigned int address, unsigned int value)
+{
+  sprintf(command_buffer, "sudo io -4 -w 0x%x 0x%x", address, value);
+  int length = run_command(command_buffer);
+  if (length < 0)
+  {
+    printf("set_register returned an error\n");
+    return length;
+  }
+  count_register_writes(1);
+  return 0;
+}
+
+
+int io_read_many(const unsigned int *addresses, unsigned int *values, int count)
+{
+  // chain as many reads as the command buffer holds into one shell
+  int i = 0;
+  while (i < count)
+  {
+    int first = i;
+    int length = 0;
+    while (i < count && length + 32 < COMMAND_BUFFER_SIZE)
+    {
+      length += sprintf(&command_buffer[length], "sudo io -4 -r 0x%x;", addresses[i ++]);
+    }
+    FILE *fp = popen(command_buffer, "r");
+    if (fp == NULL)
+    {
+      return -1;
+    }
+    int j = first;
+    while (j < i && fgets(output_buffer, OUTPUT_BUFFER_SIZE, fp) != NULL)
+    {
+      if (strlen(output_buffer) < 12)
+      {
+        break;
+      }
+      values[j ++] = strtoul(&output_buffer[11], NULL, 16);
+    }
+    if (pclose(fp) || j < i)
+    {
+      printf("get_register returned an error\n");
+      return -2;
+    }
+    count_register_reads(i - first);
+  }
+  return 0;
+}
+
+
+int io_write_masked(unsigned int address, unsigned int mask, unsigned int value)
+{
+  unsigned int old;
+  if (io_read32(address, &old) < 0)
+  {
+    return -1;
+  }
+  return io_write32(address, (old & ~mask) | (value & mask));
+}
+
+
+const RegisterBackend io_backend = {
+  "io", io_open, io_close, io_read32, io_write32, io_read_many, io_write_masked
+};
+
+
+// memory mapped backend
+
+void mem_close()
+{
+  for (int i = 0; i < REGISTER_WINDOWS; i ++)
+  {
+    if (register_windows[i].ptr != NULL)
+    {
+      munmap((void *)register_windows[i].ptr, register_windows[i].size);
+      register_windows[i].ptr = NULL;
+    }
+  }
+}
+
+
+int map_register_windows(const char *path, bool fake)
+{
+  int fd = open(path, fake ? (O_RDWR | O_CREAT) : (O_RDWR | O_SYNC), 0644);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (fake)
+  {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < REGISTER_FILE_SIZE && ftruncate(fd, REGISTER_FILE_SIZE) < 0))
+    {
+      close(fd);
+      return -1;
+    }
+  }
+  for (int i = 0; i < REGISTER_WINDOWS; i ++)
+  {
+    off_t offset = fake ? register_windows[i].file_offset : register_windows[i].base;
+    void *ptr = mmap(NULL, register_windows[i].size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if (ptr == MAP_FAILED)
+    {
+      close(fd);
+      mem_close();
+      return -1;
+    }
+    register_windows[i].ptr = (volatile unsigned int *)ptr;
+  }
+  close(fd);  // the mappings stay valid after closing
+  register_file_is_fake = fake;
+  return 0;
+}
+
+
+int mem_open()
+{
+  const char *file = getenv("VGP_MEM_FILE");
+  if (file != NULL)
+  {
+    return map_register_windows(file, true);
+  }
+  const char *device = getenv("VGP_MEM_DEVICE");
+  return map_register_windows(device != NULL ? device : "/dev/mem", false);
+}
+
+
+volatile unsigned int * get_register_pointer(unsigned int address)
+{
+  for (int i = 0; i < REGISTER_WINDOWS; i ++)
+  {
+    if (address >= register_windows[i].base && address - register_windows[i].base < register_windows[i].size)
+    {
+      return register_windows[i].ptr + ((address - register_windows[i].base) >> 2);
+    }
+  }
+  fprintf(stderr, "Register 0x%x is not mapped\n", address);
+  return NULL;
+}
+
+
+int mem_read32(unsigned int address, unsigned int *value)
+{
+  volatile unsigned int *reg = get_register_pointer(address);
+  if (reg == NULL)
+  {
+    return -1;
+  }
+  *value = *reg;
+  count_register_reads(1);
+  return 0;
+}
+
+
+int mem_write32(unsigned int address, unsigned int value)
+{
+  volatile unsigned int *reg = get_register_pointer(address);
+  if (reg == NULL)
+  {
+    return -1;
+  }
+  if (register_file_is_fake && is_hiword_mask_register(address))
+  {
+    // a plain file has no write enable bits, emulate them
+    unsigned int mask = value >> 16;
+    value = (*reg & ~mask) | (value & mask);
+  }
+  *reg = value;
+  count_register_writes(1);
+  return 0;
+}
+
+
+int mem_read_many(const unsigned int *addresses, unsigned int *values, int count)
+{
+  for (int i = 0; i < count; i ++)
+  {
+    if (mem_read32(addresses[i], &values[i]) < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int mem_write_masked(unsigned int address, unsigned int mask, unsigned int value)
+{
+  volatile unsigned int *reg = get_register_pointer(address);
+  if (reg == NULL)
+  {
+    return -1;
+  }
+  *reg = (*reg & ~mask) | (value & mask);
+  count_register_reads(1);
+  count_register_writes(1);
+  return 0;
+}
+
+
+const RegisterBackend mem_backend = {
+  "mem", mem_open, mem_close, mem_read32, mem_write32, mem_read_many, mem_write_masked
+};
+
+
+// in-memory simulator of the five GPIO banks and their IOMUX registers
+
+unsigned int sim_dr[5];
+unsigned int sim_ddr[5];
+unsigned int sim_input[5];
+unsigned int sim_iomux[5][4];
+
+
+int sim_open()
+{
+  memset(sim_dr, 0, sizeof(sim_dr));
+  memset(sim_ddr, 0, sizeof(sim_ddr));
+  memset(sim_input, 0, sizeof(sim_input));
+  memset(sim_iomux, 0, sizeof(sim_iomux));
+  return 0;
+}
+
+
+void sim_close()
+{
+}
+
+
+unsigned int * get_sim_register(unsigned int address, bool *ext_port)
+{
+  *ext_port = false;
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    if (address == GPIO_BASE[ch] + GPIO_SWPORTA_DR)
+    {
+      return &sim_dr[ch];
+    }
+    if (address == GPIO_BASE[ch] + GPIO_SWPORTA_DDR)
+    {
+      return &sim_ddr[ch];
+    }
+    if (address == GPIO_BASE[ch] + GPIO_EXT_PORTA)
+    {
+      *ext_port = true;
+      return &sim_input[ch];
+    }
+    for (int group = 0; group < 4; group ++)
+    {
+      if (GPIO_IOMUX[ch][group] != -1 && address == (ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group])
+      {
+        return &sim_iomux[ch][group];
+      }
+    }
+  }
+  fprintf(stderr, "Register 0x%x is not simulated\n", address);
+  return NULL;
+}
+
+
+int sim_read32(unsigned int address, unsigned int *value)
+{
+  bool ext_port;
+  unsigned int *reg = get_sim_register(address, &ext_port);
+  if (reg == NULL)
+  {
+    return -1;
+  }
+  if (ext_port)
+  {
+    // output pins read back what is driven, input pins what is applied
+    int ch = reg - sim_input;
+    *value = (sim_dr[ch] & sim_ddr[ch]) | (sim_input[ch] & ~sim_ddr[ch]);
+  }
+  else
+  {
+    *value = *reg;
+  }
+  count_register_reads(1);
+  return 0;
+}
+
+
+int sim_write32(unsigned int address, unsigned int value)
+{
+  bool ext_port;
+  unsigned int *reg = get_sim_register(address, &ext_port);
+  if (reg == NULL)
+  {
+    return -1;
+  }
+  if (is_hiword_mask_register(address))
+  {
+    unsigned int mask = value >> 16;
+    *reg = (*reg & ~mask) | (value & mask);
+  }
+  else if (!ext_port)
+  {
+    *reg = value;
+  }
+  count_register_writes(1);
+  return 0;
+}
+
+
+int sim_read_many(const unsigned int *addresses, unsigned int *values, int count)
+{
+  for (int i = 0; i < count; i ++)
+  {
+    if (sim_read32(addresses[i], &values[i]) < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+int sim_write_masked(unsigned int address, unsigned int mask, unsigned int value)
+{
+  unsigned int old;
+  if (sim_read32(address, &old) < 0)
+  {
+    return -1;
+  }
+  return sim_write32(address, (old & ~mask) | (value & mask));
+}
+
+
+const RegisterBackend sim_backend = {
+  "sim", sim_open, sim_close, sim_read32, sim_write32, sim_read_many, sim_write_masked
+};
+
+
+void set_simulated_inputs(int ch, unsigned int value)
+{
+  sim_input[ch] = value;
+}
+
+
+// backend selection and accounting
+
+static const RegisterBackend * register_backends[] = { NULL, &io_backend, &mem_backend, &sim_backend };
+
+
+void close_register_backend()
+{
+  if (register_ops != NULL)
+  {
+    flush_register_batch();
+    register_ops->close();
+    register_ops = NULL;
+  }
+  register_backend = -1;
+}
+
+
+int set_register_backend(int backend)
+{
+  close_register_backend();
+  if (backend == REGISTER_BACKEND_AUTO || backend == REGISTER_BACKEND_MEM)
+  {
+    if (mem_backend.open() == 0)
+    {
+      register_backend = REGISTER_BACKEND_MEM;
+      register_ops = &mem_backend;
+      return register_backend;
+    }
+    if (backend == REGISTER_BACKEND_MEM)
+    {
+      perror("Can not map registers, falling back to io");
+    }
+    backend = REGISTER_BACKEND_IO;
+  }
+  if (backend != REGISTER_BACKEND_IO && backend != REGISTER_BACKEND_SIM)
+  {
+    fprintf(stderr, "Unknown register backend %d\n", backend);
+    return -1;
+  }
+  register_backend = backend;
+  register_ops = register_backends[backend];
+  register_ops->open();
+  return register_backend;
+}
+
+
+void check_register_budget()
+{
+  RegisterStats stats;
+  get_register_stats(&stats);
+  unsigned long accesses = stats.reads + stats.writes;
+  if (getenv("VGP_REGISTER_STATS") != NULL)
+  {
+    fprintf(stderr, "register accesses (%s): %lu reads, %lu writes, %lu bytes read, %lu bytes written\n",
+      register_ops != NULL ? register_ops->name : "none", stats.reads, stats.writes,
+      stats.bytes_read, stats.bytes_written);
+  }
+  const char *budget = getenv("VGP_REGISTER_BUDGET");
+  if (budget != NULL && accesses > strtoul(budget, NULL, 0))
+  {
+    fprintf(stderr, "register access budget exceeded: %lu > %s\n", accesses, budget);
+    close_register_backend();
+    _exit(EXIT_FAILURE);
+  }
+  close_register_backend();
+}
+
+
+int get_register_backend()
+{
+  if (register_backend == -1)
+  {
+    // VGP_BACKEND=io/mem/sim selects the backend, otherwise try /dev/mem first
+    const char *name = getenv("VGP_BACKEND");
+    int backend = REGISTER_BACKEND_AUTO;
+    for (int i = 1; name != NULL && i < sizeof(register_backends) / sizeof(register_backends[0]); i ++)
+    {
+      if (strcasecmp(name, register_backends[i]->name) == 0)
+      {
+        backend = i;
+      }
+    }
+    set_register_backend(backend);
+    static bool exit_handler_installed = false;
+    if (!exit_handler_installed)
+    {
+      atexit(check_register_budget);
+      exit_handler_installed = true;
+    }
+  }
+  return register_backend;
+}
+
+
+const RegisterBackend * get_register_ops()
+{
+  get_register_backend();
+  return register_ops;
+}
+
+
+void get_register_stats(RegisterStats *stats)
+{
+  stats->reads = __atomic_load_n(&register_stats.reads, __ATOMIC_RELAXED);
+  stats->writes = __atomic_load_n(&register_stats.writes, __ATOMIC_RELAXED);
+  stats->bytes_read = __atomic_load_n(&register_stats.bytes_read, __ATOMIC_RELAXED);
+  stats->bytes_written = __atomic_load_n(&register_stats.bytes_written, __ATOMIC_RELAXED);
+}
+
+
+void reset_register_stats()
+{
+  __atomic_store_n(&register_stats.reads, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&register_stats.writes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&register_stats.bytes_read, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&register_stats.bytes_written, 0, __ATOMIC_RELAXED);
+}
+
+
+bool is_hiword_mask_register(unsigned int address)
+{
+  // GRF/PMUGRF registers take a write enable mask in the upper 16 bits
+  return (address >= PMUGRF && address < PMUGRF + 0x10000) || (address >= GRF && address < GRF + 0x10000);
+}
+
+
+// Register write batching: while a batch is open the last write is held
+// back, and consecutive writes to the same register are merged into it.
+// The pending write keeps the mask of the bits it changes, and is flushed
+// as one masked store under the register lock, so the lock is only held
+// for the store and not for the whole batch.
+
+bool register_batch_active = false;
+
+bool pending_write = false;
+
+unsigned int pending_address;
+
+unsigned int pending_value;
+
+unsigned int pending_mask;
+
+
+int flush_register_batch()
+{
+  if (!pending_write)
+  {
+    return 0;
+  }
+  pending_write = false;
+  if (pending_mask == 0xffffffff || is_hiword_mask_register(pending_address))
+  {
+    return get_register_ops()->write32(pending_address, pending_value);
+  }
+  if (lock_registers() < 0)
+  {
+    return -1;
+  }
+  int ret = get_register_ops()->write_masked(pending_address, pending_mask, pending_value);
+  unlock_registers();
+  return ret;
+}
+
+
+// Register lock: an flock on REGISTER_LOCK_FILE serializes read-modify-write
+// sequences between vgp processes, a recursive mutex between the threads of
+// one process. It nests, only the outermost lock_registers() takes the file lock.
+
+int register_lock_fd = -1;
+
+int register_lock_depth = 0;
+
+pthread_mutex_t register_lock_mutex;
+
+pthread_once_t register_lock_once = PTHREAD_ONCE_INIT;
+
+
+void init_register_lock()
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&register_lock_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+
+int lock_registers()
+{
+  pthread_once(&register_lock_once, init_register_lock);
+  pthread_mutex_lock(&register_lock_mutex);
+  if (register_lock_depth ++ > 0 || get_register_backend() == REGISTER_BACKEND_SIM)
+  {
+    return 0;
+  }
+  if (register_lock_fd < 0)
+  {
+    const char *path = getenv("VGP_REGISTER_LOCK");
+    register_lock_fd = open(path ? path : REGISTER_LOCK_FILE, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (register_lock_fd < 0)
+    {
+      return 0;  // without a lock file we still work, just unserialized
+    }
+  }
+  while (flock(register_lock_fd, LOCK_EX) < 0)
+  {
+    if (errno != EINTR)
+    {
+      perror("Can not lock registers");
+      register_lock_depth --;
+      pthread_mutex_unlock(&register_lock_mutex);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+void unlock_registers()
+{
+  if (register_lock_depth == 0)
+  {
+    return;
+  }
+  if (-- register_lock_depth == 0 && register_lock_fd >= 0)
+  {
+    flock(register_lock_fd, LOCK_UN);
+  }
+  pthread_mutex_unlock(&register_lock_mutex);
+}
+
+
+void end_register_batch_at_exit()
+{
+  end_register_batch();
+}
+
+
+void begin_register_batch()
+{
+  static bool exit_handler_installed = false;
+  if (!exit_handler_installed)
+  {
+    // a command that exits in the middle of a batch still gets its writes out
+    atexit(end_register_batch_at_exit);
+    exit_handler_installed = true;
+  }
+  register_batch_active = true;
+}
+
+
+int end_register_batch()
+{
+  register_batch_active = false;
+  return flush_register_batch();
+}
+
+
+bool suspend_register_batch()
+{
+  bool active = register_batch_active;
+  end_register_batch();
+  return active;
+}
+
+
+void resume_register_batch(bool suspended)
+{
+  if (suspended)
+  {
+    begin_register_batch();
+  }
+}
+
+
+int read_register(unsigned int address, unsigned int *value)
+{
+  STATS_BEGIN();
+  if (pending_write)
+  {
+    if (address == pending_address && pending_mask == 0xffffffff && !is_hiword_mask_register(address))
+    {
+      *value = pending_value;
+      STATS_RETURN(STAT_REGISTER_READ, 0);
+    }
+    flush_register_batch();
+  }
+  STATS_RETURN(STAT_REGISTER_READ, get_register_ops()->read32(address, value));
+}
+
+
+int write_register(unsigned int address, unsigned int value)
+{
+  STATS_BEGIN();
+  if (!register_batch_active)
+  {
+    STATS_RETURN(STAT_REGISTER_WRITE, get_register_ops()->write32(address, value));
+  }
+  if (pending_write && address == pending_address && is_hiword_mask_register(address))
+  {
+    // merge the write enable masks and take the newer bits where they overlap
+    unsigned int mask = value >> 16;
+    unsigned int data = (pending_value & ~mask) | (value & mask);
+    pending_value = ((pending_value | value) & 0xffff0000) | (data & 0xffff);
+    STATS_RETURN(STAT_REGISTER_WRITE, 0);
+  }
+  if (!pending_write || address != pending_address)
+  {
+    int ret = flush_register_batch();
+    if (ret < 0)
+    {
+      STATS_RETURN(STAT_REGISTER_WRITE, ret);
+    }
+  }
+  pending_write = true;
+  pending_address = address;
+  pending_value = value;
+  pending_mask = 0xffffffff;
+  STATS_RETURN(STAT_REGISTER_WRITE, 0);
+}
+
+
+int read_registers(const unsigned int *addresses, unsigned int *values, int count)
+{
+  STATS_BEGIN();
+  flush_register_batch();
+  STATS_RETURN(STAT_REGISTER_READ, get_register_ops()->read_many(addresses, values, count));
+}
+
+
+int write_register_masked(unsigned int address, unsigned int mask, unsigned int value)
+{
+  if (is_hiword_mask_register(address))
+  {
+    // no need to read the register back, the write enable bits protect the rest
+    mask &= 0xffff;
+    return write_register(address, (mask << 16) | (value & mask));
+  }
+  if (register_batch_active)
+  {
+    // merged into the pending write, the store reads the register again
+    if (pending_write && address != pending_address && flush_register_batch() < 0)
+    {
+      return -1;
+    }
+    if (!pending_write)
+    {
+      pending_write = true;
+      pending_address = address;
+      pending_value = 0;
+      pending_mask = 0;
+    }
+    pending_value = (pending_value & ~mask) | (value & mask);
+    pending_mask |= mask;
+    return 0;
+  }
+  STATS_BEGIN();
+  if (lock_registers() < 0)
+  {
+    STATS_RETURN(STAT_REGISTER_WRITE, -1);
+  }
+  int ret = get_register_ops()->write_masked(address, mask, value);
+  unlock_registers();
+  STATS_RETURN(STAT_REGISTER_WRITE, ret);
+}
+
+
 int get_register(unsigned int address)
 {
-    sprintf(command_buffer, "sudo io -4 -r 0x%x", address);
-    int length = run_command(command_buffer);
-    if (length < 12)
-    {
-      printf("get_register returned an error\n");
-      return -1;
-    }
-    strcpy(output_buffer, &output_buffer[11]);
-    return strtol(output_buffer, NULL, 16);
+  unsigned int value;
+  if (read_register(address, &value) < 0)
+  {
+    return -1;
+  }
+  return value;
+}
+
+
+int set_register(unsigned int address, unsigned int value)
+{
+  return write_register(address, value);
+}
+
+
+struct gpiod_chip * open_chip(int ch)
+{
+  // VGP_GPIOCHIP_BASE shifts the chip numbers, e.g. to run against gpio-sim
+  static int base = -1;
+  if (base == -1)
+  {
+    const char *env = getenv("VGP_GPIOCHIP_BASE");
+    base = (env != NULL) ? atoi(env) : 0;
+  }
+  char path[32];
+  sprintf(path, "/dev/gpiochip%d", base + ch);
+  return gpiod_chip_open(path);
+}
+
+
+// vgpd client: when attached, the pin primitives are forwarded to the daemon
+
+int vgpd_client_fd = -1;
+
+
+const char * get_vgpd_socket_path()
+{
+  const char *path = getenv("VGPD_SOCKET");
+  return path != NULL ? path : VGPD_SOCKET_PATH;
+}
+
+
+int vgpd_connect()
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, get_vgpd_socket_path(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+int vgpd_attach()
+{
+  if (vgpd_client_fd < 0 && getenv("VGP_NO_DAEMON") == NULL)
+  {
+    vgpd_client_fd = vgpd_connect();
+  }
+  return vgpd_client_fd >= 0 ? 0 : -1;
+}
+
+
+void vgpd_detach()
+{
+  if (vgpd_client_fd >= 0)
+  {
+    close(vgpd_client_fd);
+    vgpd_client_fd = -1;
+  }
+}
+
+
+int vgpd_call(int fd, VgpdRecord *records, int count)
+{
+  if (count <= 0 || count > VGPD_MAX_RECORDS)
+  {
+    return -1;
+  }
+  VgpdFrame frame;
+  frame.header.magic = VGPD_MAGIC;
+  frame.header.type = VGPD_FRAME_REQUEST;
+  frame.header.count = count;
+  frame.header.reserved = 0;
+  memcpy(frame.records, records, count * sizeof(VgpdRecord));
+  size_t length = sizeof(VgpdHeader) + count * sizeof(VgpdRecord);
+  if (send(fd, &frame, length, MSG_NOSIGNAL) != length)
+  {
+    return -1;
+  }
+  while (1)
+  {
+    // event frames of a subscribed connection are skipped here
+    ssize_t n = recv(fd, &frame, sizeof(frame), 0);
+    if (n < (ssize_t)sizeof(VgpdHeader) || frame.header.magic != VGPD_MAGIC)
+    {
+      return -1;
+    }
+    if (frame.header.type == VGPD_FRAME_RESPONSE)
+    {
+      if (frame.header.count != count || n != length)
+      {
+        return -1;
+      }
+      memcpy(records, frame.records, count * sizeof(VgpdRecord));
+      return 0;
+    }
+  }
+}
+
+
+int vgpd_single(int op, int target, int arg)
+{
+  VgpdRecord record;
+  record.op = op;
+  record.target = target;
+  record.arg = arg;
+  record.result = -1;
+  if (vgpd_call(vgpd_client_fd, &record, 1) < 0)
+  {
+    fprintf(stderr, "Lost connection to vgpd\n");
+    return -1;
+  }
+  return record.result;
+}
+
+
+int vgpd_read_events(int fd, EdgeEvent *events, int max)
+{
+  VgpdFrame frame;
+  ssize_t n = recv(fd, &frame, sizeof(frame), 0);
+  if (n < (ssize_t)sizeof(VgpdHeader) || frame.header.magic != VGPD_MAGIC)
+  {
+    return -1;
+  }
+  if (frame.header.type != VGPD_FRAME_EVENT)
+  {
+    return 0;
+  }
+  int count = 0;
+  for (int i = 0; i < frame.header.count && count < max; i ++)
+  {
+    events[count].pin = frame.events[i].pin;
+    events[count].edge = frame.events[i].edge;
+    events[count].timestamp = frame.events[i].timestamp;
+    events[count].sequence = frame.events[i].sequence;
+    count ++;
+  }
+  return count;
+}
+
+
+int get_chip_number(char *pin_name)
+{
+  return pin_name[0] - 0x30;
+}
+
+
+int get_line_number(char *pin_name)
+{
+  return ((pin_name[1] - 0x41) << 3) + (pin_name[2] - 0x30);
+}
+
+
+int get_dir(int ch, int ln)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_MODE, vgpd_single(VGPD_OP_MODE, VGPD_LINE(ch, ln), -1));
+  }
+  unsigned int gpio_directions;
+  if (read_register(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, &gpio_directions) < 0)
+  {
+    STATS_RETURN(STAT_MODE, -1);
+  }
+  STATS_RETURN(STAT_MODE, (gpio_directions >> ln) & 0x01);
+}
+
+
+int set_dir(int ch, int ln, int dir)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_MODE, vgpd_single(VGPD_OP_MODE, VGPD_LINE(ch, ln), dir));
+  }
+  if (dir != GPIO_INPUT && dir != GPIO_OUTPUT)
+  {
+    fprintf(stderr, "Unknown direction %d\n", dir);
+    STATS_RETURN(STAT_MODE, -3);
+  }
+  release_cached_line(ch, ln);  // the request would no longer match the direction
+  STATS_RETURN(STAT_MODE, write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, 0x01 << ln, dir << ln));
+}
+
+
+int get_iomux_address(int ch, int ln)
+{
+  int group = ln / 8;
+  return (GPIO_IOMUX[ch][group] == -1) ? -1 : (ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group];
+}
+
+
+int get_alt(int ch, int ln)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_ALT, vgpd_single(VGPD_OP_ALT, VGPD_LINE(ch, ln), -1));
+  }
+  int index = ln % 8;
+  int address = get_iomux_address(ch, ln);
+  unsigned int iomux;
+  if (address != -1 && read_register(address, &iomux) == 0)
+  {
+    STATS_RETURN(STAT_ALT, ((iomux >> (index << 1)) & 0x03));
+  }
+  STATS_RETURN(STAT_ALT, -1);
+}
+
+
+int set_alt(int ch, int ln, int alt)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_ALT, vgpd_single(VGPD_OP_ALT, VGPD_LINE(ch, ln), alt));
+  }
+  int index = ln % 8;
+  if (alt < 0 || alt > 3)
+  {
+    fprintf(stderr, "Unsupported ALT value %d\n", alt);
+    STATS_RETURN(STAT_ALT, -2);
+  }
+  int address = get_iomux_address(ch, ln);
+  if (address != -1)
+  {
+    release_cached_line(ch, ln);
+    STATS_RETURN(STAT_ALT, write_register_masked(address, 0x03 << (index << 1), alt << (index << 1)));
+  }
+  STATS_RETURN(STAT_ALT, -1);
+}
+
+
+int read_board_snapshot(BoardSnapshot *snapshot)
+{
+  STATS_BEGIN();
+  // DR, EXT_PORTA and DDR of all banks plus the IOMUX registers, in one batch
+  unsigned int addresses[15 + 18];
+  unsigned int *values[15 + 18];
+  int count = 0;
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    addresses[count] = GPIO_BASE[ch] + GPIO_SWPORTA_DR;
+    values[count ++] = &snapshot->dr[ch];
+    addresses[count] = GPIO_BASE[ch] + GPIO_EXT_PORTA;
+    values[count ++] = &snapshot->ext[ch];
+    addresses[count] = GPIO_BASE[ch] + GPIO_SWPORTA_DDR;
+    values[count ++] = &snapshot->ddr[ch];
+    for (int group = 0; group < 4; group ++)
+    {
+      snapshot->iomux[ch][group] = 0;
+      if (GPIO_IOMUX[ch][group] != -1)
+      {
+        addresses[count] = (ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group];
+        values[count ++] = &snapshot->iomux[ch][group];
+      }
+    }
+  }
+  unsigned int results[15 + 18];
+  if (read_registers(addresses, results, count) < 0)
+  {
+    STATS_RETURN(STAT_SNAPSHOT, -1);
+  }
+  for (int i = 0; i < count; i ++)
+  {
+    *values[i] = results[i];
+  }
+  STATS_RETURN(STAT_SNAPSHOT, 0);
+}
+
+
+int snapshot_get_alt(const BoardSnapshot *snapshot, int ch, int ln)
+{
+  int group = ln / 8;
+  int index = ln % 8;
+  if (GPIO_IOMUX[ch][group] == -1)
+  {
+    return -1;
+  }
+  return (snapshot->iomux[ch][group] >> (index << 1)) & 0x03;
+}
+
+
+int snapshot_get_dir(const BoardSnapshot *snapshot, int ch, int ln)
+{
+  return (snapshot->ddr[ch] >> ln) & 0x01;
+}
+
+
+int snapshot_get_value(const BoardSnapshot *snapshot, int ch, int ln)
+{
+  unsigned int values = snapshot_get_dir(snapshot, ch, ln) == GPIO_INPUT ? snapshot->ext[ch] : snapshot->dr[ch];
+  return (values >> ln) & 0x01;
+}
+
+
+void profile_init(PinProfile *profile)
+{
+  memset(profile, 0, sizeof(PinProfile));
+}
+
+
+int profile_set(PinProfile *profile, int ch, int ln, int alt, int dir, int value)
+{
+  if (ch < 0 || ch > 4 || ln < 0 || ln > 31 || GPIO_IOMUX[ch][ln / 8] == -1 || alt < 0 || alt > 3
+    || (dir != GPIO_INPUT && dir != GPIO_OUTPUT))
+  {
+    return -1;
+  }
+  int shift = (ln % 8) << 1;
+  profile->mask[ch] |= (1u << ln);
+  profile->iomux[ch][ln / 8] = (profile->iomux[ch][ln / 8] & ~(0x03u << shift)) | ((unsigned int)alt << shift);
+  profile->ddr[ch] = (profile->ddr[ch] & ~(1u << ln)) | ((unsigned int)dir << ln);
+  profile->dr[ch] = (profile->dr[ch] & ~(1u << ln)) | ((value ? 1u : 0) << ln);
+  return 0;
+}
+
+
+// Writes only the registers that differ from the profile: the IOMUX
+// registers first, then the levels and then the directions of each bank,
+// so that lines becoming outputs start at their new level. Returns the
+// number of registers written.
+int profile_apply(const PinProfile *profile)
+{
+  bool batched = suspend_register_batch();
+  if (lock_registers() < 0)
+  {
+    resume_register_batch(batched);
+    return -1;
+  }
+  int written = 0;
+  BoardSnapshot live;
+  if (read_board_snapshot(&live) < 0)
+  {
+    written = -1;
+  }
+  for (int ch = 0; ch < 5 && written >= 0; ch ++)
+  {
+    for (int group = 0; group < 4 && written >= 0; group ++)
+    {
+      unsigned int lines = (profile->mask[ch] >> (group * 8)) & 0xff;
+      unsigned int mask = 0;
+      for (int index = 0; index < 8; index ++)
+      {
+        mask |= (lines & (1u << index)) ? (0x03u << (index << 1)) : 0;
+      }
+      mask &= live.iomux[ch][group] ^ profile->iomux[ch][group];
+      if (mask != 0 && GPIO_IOMUX[ch][group] != -1)
+      {
+        for (int ln = group * 8; ln < group * 8 + 8; ln ++)
+        {
+          if (mask & (0x03u << ((ln % 8) << 1)))
+          {
+            release_cached_line(ch, ln);
+          }
+        }
+        written = (write_register_masked((ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group], mask, profile->iomux[ch][group]) < 0)
+          ? -1 : written + 1;
+      }
+    }
+  }
+  for (int ch = 0; ch < 5 && written >= 0; ch ++)
+  {
+    unsigned int levels = profile->mask[ch] & profile->ddr[ch] & (live.dr[ch] ^ profile->dr[ch]);
+    if (levels != 0)
+    {
+      written = (write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DR, levels, profile->dr[ch]) < 0) ? -1 : written + 1;
+    }
+    unsigned int dirs = profile->mask[ch] & (live.ddr[ch] ^ profile->ddr[ch]);
+    if (dirs != 0 && written >= 0)
+    {
+      for (int ln = 0; ln < 32; ln ++)
+      {
+        if (dirs & (1u << ln))
+        {
+          release_cached_line(ch, ln);
+        }
+      }
+      written = (write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, dirs, profile->ddr[ch]) < 0) ? -1 : written + 1;
+    }
+  }
+  unlock_registers();
+  resume_register_batch(batched);
+  return written;
+}
+
+
+void bank_write_init(BankWrite *bw)
+{
+  memset(bw, 0, sizeof(BankWrite));
+}
+
+
+void bank_write_add(BankWrite *bw, int ch, int ln, int val)
+{
+  bw->mask[ch] |= (1u << ln);
+  bw->value[ch] = (bw->value[ch] & ~(1u << ln)) | ((val ? 1u : 0) << ln);
+}
+
+
+int bank_write_apply(const BankWrite *bw)
+{
+  if (lock_registers() < 0)
+  {
+    return -1;
+  }
+  int ret = 0;
+  for (int ch = 0; ch < 5 && ret == 0; ch ++)
+  {
+    unsigned int mask = bw->mask[ch];
+    if (mask == 0)
+    {
+      continue;
+    }
+    unsigned int addresses[2] = { GPIO_BASE[ch] + GPIO_SWPORTA_DR, GPIO_BASE[ch] + GPIO_SWPORTA_DDR };
+    unsigned int regs[2];
+    if (read_registers(addresses, regs, 2) < 0)
+    {
+      ret = -1;
+      break;
+    }
+    // levels first, so lines that become outputs start at their new value
+    ret = write_register_masked(addresses[0], mask, bw->value[ch]);
+    if (ret == 0 && (regs[1] & mask) != mask)
+    {
+      for (int ln = 0; ln < 32; ln ++)
+      {
+        if ((mask & ~regs[1]) & (1u << ln))
+        {
+          release_cached_line(ch, ln);
+        }
+      }
+      ret = write_register_masked(addresses[1], mask, mask);
+    }
+  }
+  unlock_registers();
+  return ret;
+}
+
+
+// for pins that are already outputs: one masked store per bank, straight to
+// the backend, so that threads do not take part in a batch opened by another
+int bank_write_outputs(const BankWrite *bw)
+{
+  if (lock_registers() < 0)
+  {
+    return -1;
+  }
+  int ret = 0;
+  for (int ch = 0; ch < 5 && ret == 0; ch ++)
+  {
+    if (bw->mask[ch] != 0)
+    {
+      ret = get_register_ops()->write_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DR, bw->mask[ch], bw->value[ch]);
+    }
+  }
+  unlock_registers();
+  return ret;
+}
+
+
+int bus_init(Bus *bus, const char *name, const int *pins, int width)
+{
+  memset(bus, 0, sizeof(Bus));
+  bus->name = name;
+  if (width <= 0 || width > BUS_MAX_PINS)
+  {
+    fprintf(stderr, "Bus width must be 1 to %d\n", BUS_MAX_PINS);
+    return -1;
+  }
+  bus->width = width;
+  for (int bit = 0; bit < width; bit ++)
+  {
+    int pin = pins[bit];
+    if (pin <= 0 || pin > 40 || is_power_pin(pin))
+    {
+      fprintf(stderr, "Pin %d can not be on a bus\n", pin);
+      return -1;
+    }
+    int ch = get_chip_number((char *)NAMES[pin]);
+    int ln = get_line_number((char *)NAMES[pin]);
+    if (bus->bank_mask[ch] & (1u << ln))
+    {
+      fprintf(stderr, "Pin %d is used twice on the bus\n", pin);
+      return -1;
+    }
+    bus->pins[bit] = pin;
+    bus->bank_mask[ch] |= (1u << ln);
+    BusSegment *last = bus->segment_count > 0 ? &bus->segments[bus->segment_count - 1] : NULL;
+    if (last != NULL && last->ch == ch && bit + last->shift == ln)
+    {
+      last->word_mask |= (1u << bit);
+    }
+    else
+    {
+      BusSegment *seg = &bus->segments[bus->segment_count ++];
+      seg->ch = ch;
+      seg->word_mask = (1u << bit);
+      seg->shift = ln - bit;
+    }
+  }
+  return 0;
+}
+
+
+int bus_set_dir(const Bus *bus, int dir)
+{
+  if (dir != GPIO_INPUT && dir != GPIO_OUTPUT)
+  {
+    fprintf(stderr, "Unknown direction %d\n", dir);
+    return -3;
+  }
+  int ret = 0;
+  for (int ch = 0; ch < 5 && ret == 0; ch ++)
+  {
+    if (bus->bank_mask[ch] != 0)
+    {
+      for (int ln = 0; ln < 32; ln ++)
+      {
+        if (bus->bank_mask[ch] & (1u << ln))
+        {
+          release_cached_line(ch, ln);
+        }
+      }
+      ret = write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, bus->bank_mask[ch], dir ? 0xffffffff : 0);
+    }
+  }
+  return ret;
+}
+
+
+unsigned int shift_bits(unsigned int bits, int shift)
+{
+  return shift >= 0 ? bits << shift : bits >> -shift;
+}
+
+
+int bus_write(const Bus *bus, unsigned int word)
+{
+  unsigned int values[5] = { 0 };
+  for (int i = 0; i < bus->segment_count; i ++)
+  {
+    const BusSegment *seg = &bus->segments[i];
+    values[seg->ch] |= shift_bits(word & seg->word_mask, seg->shift);
+  }
+  if (lock_registers() < 0)
+  {
+    return -1;
+  }
+  int ret = 0;
+  for (int ch = 0; ch < 5 && ret == 0; ch ++)
+  {
+    if (bus->bank_mask[ch] != 0)
+    {
+      ret = write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DR, bus->bank_mask[ch], values[ch]);
+    }
+  }
+  unlock_registers();
+  return ret;
+}
+
+
+int bus_read(const Bus *bus, unsigned int *word)
+{
+  unsigned int addresses[5];
+  unsigned int values[5];
+  int banks[5];
+  int count = 0;
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    if (bus->bank_mask[ch] != 0)
+    {
+      banks[ch] = count;
+      addresses[count ++] = GPIO_BASE[ch] + GPIO_EXT_PORTA;
+    }
+  }
+  if (read_registers(addresses, values, count) < 0)
+  {
+    return -1;
+  }
+  *word = 0;
+  for (int i = 0; i < bus->segment_count; i ++)
+  {
+    const BusSegment *seg = &bus->segments[i];
+    *word |= shift_bits(values[banks[seg->ch]], -seg->shift) & seg->word_mask;
+  }
+  return 0;
+}
+
+
+// Process-wide cache of opened chips and requested lines. A line stays
+// requested until the direction it was requested with no longer fits.
+
+struct gpiod_chip * cached_chips[5];
+
+CachedLine cached_lines[5][32];
+
+bool line_cache_enabled = true;
+
+pthread_mutex_t line_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+void release_line_locked(int ch, int ln)
+{
+  if (cached_lines[ch][ln].request_type != 0)
+  {
+    gpiod_line_release(cached_lines[ch][ln].line);
+    cached_lines[ch][ln].request_type = 0;
+  }
+}
+
+
+void close_line_cache_locked()
+{
+  for (int ch = 0; ch < 5; ch ++)
+  {
+    if (cached_chips[ch] != NULL)
+    {
+      for (int ln = 0; ln < 32; ln ++)
+      {
+        release_line_locked(ch, ln);
+        cached_lines[ch][ln].line = NULL;
+      }
+      gpiod_chip_close(cached_chips[ch]);
+      cached_chips[ch] = NULL;
+    }
+  }
+}
+
+
+void close_line_cache()
+{
+  pthread_mutex_lock(&line_cache_mutex);
+  close_line_cache_locked();
+  pthread_mutex_unlock(&line_cache_mutex);
+}
+
+
+void release_cached_line(int ch, int ln)
+{
+  pthread_mutex_lock(&line_cache_mutex);
+  if (cached_chips[ch] != NULL)
+  {
+    release_line_locked(ch, ln);
+  }
+  pthread_mutex_unlock(&line_cache_mutex);
+}
+
+
+void set_line_cache_enabled(bool enabled)
+{
+  line_cache_enabled = enabled;
+  if (!enabled)
+  {
+    close_line_cache();
+  }
+}
+
+
+// returns the line requested with request_type, or a negative error code
+struct gpiod_line * get_cached_line(int ch, int ln, int request_type, int value, int *err)
+{
+  static bool exit_handler_installed = false;
+  if (!exit_handler_installed)
+  {
+    atexit(close_line_cache);
+    exit_handler_installed = true;
+  }
+  if (cached_chips[ch] == NULL)
+  {
+    cached_chips[ch] = open_chip(ch);
+    if (cached_chips[ch] == NULL)
+    {
+      *err = -1;
+      return NULL;
+    }
+  }
+  CachedLine *cached = &cached_lines[ch][ln];
+  if (cached->line == NULL)
+  {
+    cached->line = gpiod_chip_get_line(cached_chips[ch], ln);
+    if (cached->line == NULL)
+    {
+      *err = -2;
+      return NULL;
+    }
+  }
+  // any request can be read, but only an output request can be written
+  if (cached->request_type != 0 && (request_type == GPIOD_LINE_REQUEST_DIRECTION_AS_IS || cached->request_type == request_type))
+  {
+    return cached->line;
+  }
+  release_line_locked(ch, ln);
+  struct gpiod_line_request_config cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.consumer = "vgp";
+  cfg.request_type = request_type;
+  cfg.flags = 0;
+  if (gpiod_line_request(cached->line, &cfg, value) < 0)
+  {
+    *err = -3;
+    return NULL;
+  }
+  cached->request_type = request_type;
+  return cached->line;
+}
+
+
+int get(int ch, int ln)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_GET, vgpd_single(VGPD_OP_GET, VGPD_LINE(ch, ln), 0));
+  }
+  int ret = 0;
+  if (get_register_backend() == REGISTER_BACKEND_SIM)
+  {
+    unsigned int levels;
+    STATS_RETURN(STAT_GET, read_register(GPIO_BASE[ch] + GPIO_EXT_PORTA, &levels) < 0 ? -1 : (levels >> ln) & 0x01);
+  }
+  flush_register_batch();
+  pthread_mutex_lock(&line_cache_mutex);
+  struct gpiod_line *line = get_cached_line(ch, ln, GPIOD_LINE_REQUEST_DIRECTION_AS_IS, 0, &ret);
+  if (line != NULL)
+  {
+    ret = gpiod_line_get_value(line);
+  }
+  if (!line_cache_enabled)
+  {
+    close_line_cache_locked();
+  }
+  pthread_mutex_unlock(&line_cache_mutex);
+  STATS_RETURN(STAT_GET, ret);
+}
+
+
+int set(int ch, int ln, int val)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_SET, vgpd_single(VGPD_OP_SET, VGPD_LINE(ch, ln), val));
+  }
+  int ret = 0;
+  if (get_register_backend() == REGISTER_BACKEND_SIM)
+  {
+    // same effect as requesting the line as output with the given value
+    write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DR, 0x01 << ln, (val ? 1 : 0) << ln);
+    STATS_RETURN(STAT_SET, write_register_masked(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, 0x01 << ln, 0x01 << ln));
+  }
+  flush_register_batch();
+  // the kernel's read-modify-write of the bank is serialized with ours
+  if (lock_registers() < 0)
+  {
+    STATS_RETURN(STAT_SET, -1);
+  }
+  pthread_mutex_lock(&line_cache_mutex);
+  bool requested = (cached_chips[ch] != NULL && cached_lines[ch][ln].request_type == GPIOD_LINE_REQUEST_DIRECTION_OUTPUT);
+  struct gpiod_line *line = get_cached_line(ch, ln, GPIOD_LINE_REQUEST_DIRECTION_OUTPUT, val, &ret);
+  if (line != NULL)
+  {
+    // a fresh output request already drives the default value
+    ret = requested ? gpiod_line_set_value(line, val) : 0;
+  }
+  if (!line_cache_enabled)
+  {
+    close_line_cache_locked();
+  }
+  pthread_mutex_unlock(&line_cache_mutex);
+  unlock_registers();
+  STATS_RETURN(STAT_SET, ret);
+}
+
+
+// ADC channels are read from the raw attributes of the SARADC's IIO device.
+// Each attribute is opened once and re-read with pread at offset 0.
+
+int adc_fds[ADC_CHANNELS] = { -1, -1, -1, -1, -1, -1 };
+
+char adc_device_path[256];
+
+pthread_mutex_t adc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+const char * get_iio_devices_path()
+{
+  const char *path = getenv("VGP_IIO_DEVICES");
+  return path != NULL ? path : IIO_DEVICES_PATH;
+}
+
+
+// finds the IIO device whose name contains ADC_DEVICE_NAME, iio:device0 if none does
+const char * get_adc_device_path()
+{
+  if (adc_device_path[0] != '\0')
+  {
+    return adc_device_path;
+  }
+  const char *base = get_iio_devices_path();
+  snprintf(adc_device_path, sizeof(adc_device_path), "%s/iio:device0", base);
+  char path[sizeof(adc_device_path) + 16];
+  for (int i = 0; i < 16; i ++)
+  {
+    snprintf(path, sizeof(path), "%s/iio:device%d/name", base, i);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      continue;
+    }
+    char name[64];
+    ssize_t n = read(fd, name, sizeof(name) - 1);
+    close(fd);
+    name[n > 0 ? n : 0] = '\0';
+    if (strstr(name, ADC_DEVICE_NAME) != NULL)
+    {
+      snprintf(adc_device_path, sizeof(adc_device_path), "%s/iio:device%d", base, i);
+      break;
+    }
+  }
+  return adc_device_path;
+}
+
+
+int get_adc_fd(int channel)
+{
+  pthread_mutex_lock(&adc_mutex);
+  if (adc_fds[channel] < 0)
+  {
+    char path[sizeof(adc_device_path) + 32];
+    snprintf(path, sizeof(path), "%s/in_voltage%d_raw", get_adc_device_path(), channel);
+    adc_fds[channel] = open(path, O_RDONLY | O_CLOEXEC);
+    if (adc_fds[channel] < 0)
+    {
+      perror(path);
+    }
+  }
+  int fd = adc_fds[channel];
+  pthread_mutex_unlock(&adc_mutex);
+  return fd;
+}
+
+
+void close_adc()
+{
+  pthread_mutex_lock(&adc_mutex);
+  for (int i = 0; i < ADC_CHANNELS; i ++)
+  {
+    if (adc_fds[i] >= 0)
+    {
+      close(adc_fds[i]);
+      adc_fds[i] = -1;
+    }
+  }
+  adc_device_path[0] = '\0';
+  pthread_mutex_unlock(&adc_mutex);
+}
+
+
+int get_adc(int a_pin)
+{
+  STATS_BEGIN();
+  if (vgpd_client_fd >= 0)
+  {
+    STATS_RETURN(STAT_ADC, vgpd_single(VGPD_OP_ADC, a_pin, 0));
+  }
+  if (a_pin < 0 || a_pin >= ADC_CHANNELS)
+  {
+    fprintf(stderr, "Unknown ADC channel %d\n", a_pin);
+    STATS_RETURN(STAT_ADC, -1);
+  }
+  int fd = get_adc_fd(a_pin);
+  char buf[16];
+  ssize_t n = (fd < 0) ? -1 : pread(fd, buf, sizeof(buf), 0);
+  if (n <= 0)
+  {
+    printf("get_adc returned an error\n");
+    STATS_RETURN(STAT_ADC, -1);
+  }
+  int value = 0;
+  int digits = 0;
+  for (ssize_t i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i ++, digits ++)
+  {
+    value = value * 10 + (buf[i] - '0');
+  }
+  STATS_RETURN(STAT_ADC, digits > 0 ? value : -1);
+}
+
+
+float get_voltage_by_adc(int adc)
+{
+  return get_adc_scale() * adc;
+}
+
+
+int read_sysfs(const char *dir, const char *attr, char *buf, int size)
+{
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, attr);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n < 0)
+  {
+    return -1;
+  }
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+  {
+    n --;
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+
+int write_sysfs(const char *dir, const char *attr, const char *value)
+{
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir, attr);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+  ssize_t n = write(fd, value, strlen(value));
+  if (n < 0)
+  {
+    perror(path);
+  }
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+
+// volts per ADC count at the header pins: in_voltage_scale (mV per count at
+// the SARADC input) times the divider in front of it
+float get_adc_scale()
+{
+  static float scale = 0;
+  if (scale == 0)
+  {
+    char value[32];
+    float mv = (read_sysfs(get_adc_device_path(), "in_voltage_scale", value, sizeof(value)) > 0) ? atof(value) : 0;
+    scale = (mv > 0) ? mv / 1000 * ADC_INPUT_DIVIDER : ADC_DEFAULT_SCALE;
+  }
+  return scale;
+}
+
+
+// parses a scan element type like "le:u10/16>>0" or "be:s12/16X2>>4"
+int iio_parse_scan_type(const char *text, IioScanElement *element)
+{
+  char endian[3];
+  char sign;
+  int bits, storage_bits, repeat = 1, shift;
+  if (sscanf(text, "%2[bl]e:%c%d/%dX%d>>%d", endian, &sign, &bits, &storage_bits, &repeat, &shift) != 6)
+  {
+    repeat = 1;
+    if (sscanf(text, "%2[bl]e:%c%d/%d>>%d", endian, &sign, &bits, &storage_bits, &shift) != 5)
+    {
+      return -1;
+    }
+  }
+  if (repeat != 1 || (sign != 's' && sign != 'u') || bits <= 0 || bits > storage_bits
+    || (storage_bits != 8 && storage_bits != 16 && storage_bits != 32 && storage_bits != 64))
+  {
+    return -1;  // repeated elements are not used by ADCs
+  }
+  element->big_endian = (endian[0] == 'b');
+  element->is_signed = (sign == 's');
+  element->bits = bits;
+  element->storage_bits = storage_bits;
+  element->shift = shift;
+  return 0;
+}
+
+
+// reads index and type of the enabled elements and lays out the frame:
+// elements in index order, each aligned to its storage size
+int adc_stream_layout(AdcStream *stream, const char *device)
+{
+  char dir[512];
+  char attr[64];
+  char value[64];
+  snprintf(dir, sizeof(dir), "%s/scan_elements", device);
+  stream->element_count = 0;
+  stream->timestamp_element = -1;
+  int found = 0;
+  for (int ch = 0; ch <= ADC_CHANNELS; ch ++)
+  {
+    // the last round looks at the timestamp
+    char name[32] = "in_timestamp";
+    if (ch < ADC_CHANNELS)
+    {
+      snprintf(name, sizeof(name), "in_voltage%d", ch);
+    }
+    snprintf(attr, sizeof(attr), "%s_en", name);
+    if (read_sysfs(dir, attr, value, sizeof(value)) < 0 || strcmp(value, "1") != 0)
+    {
+      continue;
+    }
+    IioScanElement *e = &stream->elements[stream->element_count];
+    snprintf(attr, sizeof(attr), "%s_type", name);
+    if (read_sysfs(dir, attr, value, sizeof(value)) < 0 || iio_parse_scan_type(value, e) < 0)
+    {
+      fprintf(stderr, "Unsupported scan element type of %s: %s\n", name, value);
+      return -1;
+    }
+    snprintf(attr, sizeof(attr), "%s_index", name);
+    if (read_sysfs(dir, attr, value, sizeof(value)) < 0)
+    {
+      fprintf(stderr, "Scan element %s has no index\n", name);
+      return -1;
+    }
+    e->index = atoi(value);
+    // elements that were not asked for still take their place in the frame
+    e->channel = (ch < ADC_CHANNELS) ? -2 : -1;
+    for (int i = 0; i < stream->count && ch < ADC_CHANNELS; i ++)
+    {
+      if (stream->channels[i] == ch)
+      {
+        e->channel = i;
+        found ++;
+      }
+    }
+    stream->element_count ++;
+  }
+  if (found != stream->count)
+  {
+    fprintf(stderr, "Not all requested ADC channels are enabled in the scan\n");
+    return -1;
+  }
+  // sort by index, there are only a few elements
+  for (int i = 1; i < stream->element_count; i ++)
+  {
+    for (int j = i; j > 0 && stream->elements[j].index < stream->elements[j - 1].index; j --)
+    {
+      IioScanElement tmp = stream->elements[j];
+      stream->elements[j] = stream->elements[j - 1];
+      stream->elements[j - 1] = tmp;
+    }
+  }
+  int offset = 0;
+  int align = 1;
+  for (int i = 0; i < stream->element_count; i ++)
+  {
+    IioScanElement *e = &stream->elements[i];
+    int bytes = e->storage_bits / 8;
+    offset = (offset + bytes - 1) / bytes * bytes;
+    e->offset = offset;
+    offset += bytes;
+    align = (bytes > align) ? bytes : align;
+    if (e->channel == -1)
+    {
+      stream->timestamp_element = i;
+    }
+  }
+  stream->frame_size = (offset + align - 1) / align * align;
+  stream->buffer_size = stream->frame_size * ADC_STREAM_BLOCK_FRAMES;
+  stream->buffer = malloc(stream->buffer_size);
+  if (stream->buffer == NULL)
+  {
+    perror("Can not allocate ADC stream buffer");
+    return -1;
+  }
+  return 0;
+}
+
+
+int adc_stream_init(AdcStream *stream, const int *channels, int count)
+{
+  memset(stream, 0, sizeof(AdcStream));
+  stream->fd = -1;
+  stream->record_fd = -1;
+  if (count <= 0 || count > ADC_CHANNELS)
+  {
+    fprintf(stderr, "Can not stream %d ADC channels\n", count);
+    return -1;
+  }
+  for (int i = 0; i < count; i ++)
+  {
+    if (channels[i] < 0 || channels[i] >= ADC_CHANNELS)
+    {
+      fprintf(stderr, "Unknown ADC channel %d\n", channels[i]);
+      return -1;
+    }
+    stream->channels[i] = channels[i];
+  }
+  stream->count = count;
+  return 0;
+}
+
+
+// finds the trigger device named name, returns its sysfs directory in dir
+int find_iio_trigger(const char *name, char *dir, int size)
+{
+  char value[64];
+  for (int i = 0; i < 64; i ++)
+  {
+    snprintf(dir, size, "%s/trigger%d", get_iio_devices_path(), i);
+    if (read_sysfs(dir, "name", value, sizeof(value)) >= 0 && strcmp(value, name) == 0)
+    {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+// streams the channels at rate samples/s with a new hrtimer trigger, or
+// with an existing trigger given by name (rate is then up to the trigger)
+int adc_stream_open(AdcStream *stream, const int *channels, int count, double rate, const char *trigger)
+{
+  if (trigger == NULL && rate <= 0)
+  {
+    fprintf(stderr, "Can not sample the ADC at %g Hz\n", rate);
+    return -1;
+  }
+  if (adc_stream_init(stream, channels, count) < 0)
+  {
+    return -1;
+  }
+  const char *device = get_adc_device_path();
+  char dir[512];
+  char value[64];
+  snprintf(dir, sizeof(dir), "%s/scan_elements", device);
+  write_sysfs(device, "buffer/enable", "0");
+  for (int ch = 0; ch < ADC_CHANNELS; ch ++)
+  {
+    char attr[64];
+    snprintf(attr, sizeof(attr), "in_voltage%d_en", ch);
+    bool wanted = false;
+    for (int i = 0; i < count; i ++)
+    {
+      wanted = wanted || channels[i] == ch;
+    }
+    if (read_sysfs(dir, attr, value, sizeof(value)) >= 0 && write_sysfs(dir, attr, wanted ? "1" : "0") < 0)
+    {
+      return -1;
+    }
+  }
+  if (read_sysfs(dir, "in_timestamp_en", value, sizeof(value)) >= 0)
+  {
+    write_sysfs(dir, "in_timestamp_en", "1");
+  }
+  if (adc_stream_layout(stream, device) < 0)
+  {
+    adc_stream_close(stream);
+    return -1;
+  }
+
+  if (trigger == NULL)
+  {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", IIO_HRTIMER_CONFIGFS, ADC_STREAM_TRIGGER);
+    if (mkdir(path, 0755) == 0)
+    {
+      stream->created_trigger = true;
+    }
+    else if (errno != EEXIST)
+    {
+      perror("Can not create hrtimer trigger (is configfs mounted?)");
+      adc_stream_close(stream);
+      return -1;
+    }
+    trigger = ADC_STREAM_TRIGGER;
+    char trigger_dir[512];
+    snprintf(value, sizeof(value), "%g", rate);
+    if (find_iio_trigger(trigger, trigger_dir, sizeof(trigger_dir)) < 0
+      || write_sysfs(trigger_dir, "sampling_frequency", value) < 0)
+    {
+      fprintf(stderr, "Can not set the rate of trigger %s\n", trigger);
+      adc_stream_close(stream);
+      return -1;
+    }
+  }
+  snprintf(value, sizeof(value), "%d", ADC_STREAM_BLOCK_FRAMES * 4);
+  if (write_sysfs(device, "trigger/current_trigger", trigger) < 0 || write_sysfs(device, "buffer/length", value) < 0
+    || write_sysfs(device, "buffer/enable", "1") < 0)
+  {
+    adc_stream_close(stream);
+    return -1;
+  }
+  stream->enabled = true;
+
+  const char *node = strrchr(device, '/');
+  snprintf(dir, sizeof(dir), "/dev/%s", node != NULL ? node + 1 : device);
+  stream->fd = open(dir, O_RDONLY | O_CLOEXEC);
+  if (stream->fd < 0)
+  {
+    perror(dir);
+    adc_stream_close(stream);
+    return -1;
+  }
+  return 0;
+}
+
+
+// replays frames recorded from the character device, the layout is taken
+// from the scan elements as they are configured now
+int adc_stream_open_file(AdcStream *stream, const int *channels, int count, const char *path)
+{
+  if (adc_stream_init(stream, channels, count) < 0 || adc_stream_layout(stream, get_adc_device_path()) < 0)
+  {
+    adc_stream_close(stream);
+    return -1;
+  }
+  stream->from_file = true;
+  stream->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (stream->fd < 0)
+  {
+    perror(path);
+    adc_stream_close(stream);
+    return -1;
+  }
+  return 0;
+}
+
+
+long long decode_scan_element(const IioScanElement *e, const unsigned char *frame)
+{
+  const unsigned char *p = frame + e->offset;
+  int bytes = e->storage_bits / 8;
+  unsigned long long raw = 0;
+  for (int i = 0; i < bytes; i ++)
+  {
+    raw |= (unsigned long long)p[e->big_endian ? bytes - 1 - i : i] << (8 * i);
+  }
+  raw >>= e->shift;
+  if (e->bits < 64)
+  {
+    raw &= (1ULL << e->bits) - 1;
+    if (e->is_signed && (raw >> (e->bits - 1)) & 0x01)
+    {
+      raw |= ~0ULL << e->bits;
+    }
+  }
+  return (long long)raw;
+}
+
+
+// reads up to max frames, blocking until at least one is available;
+// returns 0 at the end of a recorded file
+int adc_stream_read(AdcStream *stream, AdcFrame *frames, int max)
+{
+  while (stream->buffered < stream->frame_size)
+  {
+    ssize_t n = read(stream->fd, stream->buffer + stream->buffered, stream->buffer_size - stream->buffered);
+    if (n < 0 && errno == EINTR)
+    {
+      return 0;
+    }
+    if (n <= 0)
+    {
+      if (n < 0)
+      {
+        perror("Error reading ADC stream");
+      }
+      return n;
+    }
+    if (stream->record_fd >= 0 && write(stream->record_fd, stream->buffer + stream->buffered, n) != n)
+    {
+      perror("Error recording ADC stream");
+    }
+    stream->buffered += n;
+  }
+  int count = 0;
+  const unsigned char *frame = stream->buffer;
+  while (count < max && stream->buffered - (frame - stream->buffer) >= stream->frame_size)
+  {
+    AdcFrame *f = &frames[count ++];
+    f->timestamp = 0;
+    for (int i = 0; i < stream->element_count; i ++)
+    {
+      const IioScanElement *e = &stream->elements[i];
+      if (e->channel == -1)
+      {
+        f->timestamp = decode_scan_element(e, frame);
+      }
+      else if (e->channel >= 0)
+      {
+        f->values[e->channel] = (int)decode_scan_element(e, frame);
+      }
+    }
+    frame += stream->frame_size;
+  }
+  // keep the unread bytes for the next call
+  int used = frame - stream->buffer;
+  memmove(stream->buffer, frame, stream->buffered - used);
+  stream->buffered -= used;
+  return count;
+}
+
+
+void adc_stream_close(AdcStream *stream)
+{
+  if (stream->fd >= 0)
+  {
+    close(stream->fd);
+    stream->fd = -1;
+  }
+  if (stream->record_fd >= 0)
+  {
+    close(stream->record_fd);
+    stream->record_fd = -1;
+  }
+  if (stream->enabled)
+  {
+    const char *device = get_adc_device_path();
+    write_sysfs(device, "buffer/enable", "0");
+    write_sysfs(device, "trigger/current_trigger", "");
+    stream->enabled = false;
+  }
+  if (stream->created_trigger)
+  {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", IIO_HRTIMER_CONFIGFS, ADC_STREAM_TRIGGER);
+    rmdir(path);
+    stream->created_trigger = false;
+  }
+  free(stream->buffer);
+  stream->buffer = NULL;
+}
+
+
+bool is_power_pin(int pin)
+{
+  if (pin == 1 || pin == 2 || pin == 4 || pin == 6 || pin == 9 || pin == 14 
+    || pin == 17 || pin == 20 || pin == 25 || pin == 30 || pin == 34 || pin == 39) {
+    return true;
+  }
+  return false;  
+}
+
+
+// GPIO pin state monitor: the monitored lines of each chip share one chip
+// handle, and one thread waits on their event fds with epoll and runs the
+// callbacks.
+
+MonitorPin monitor_pins[MONITOR_PINS];
+
+MonitorChip monitor_chips[5];
+
+pthread_mutex_t monitor_mutex;
+
+pthread_t monitor_thread;
+
+int monitor_epoll_fd = -1;
+
+int monitor_wakeup_fd = -1;
+
+
+// Edge event ring buffer: written by the monitor thread only, read by any
+// number of EventReaders that each keep their own cursor. A slot's seq is 0
+// while it is being written and sequence + 1 once it is complete.
+
+EventSlot event_ring[EVENT_RING_SIZE];
+
+unsigned long long event_head = 0;
+
+
+void push_edge_event(int pin, int edge, unsigned long long timestamp)
+{
+  unsigned long long seq = event_head;
+  EventSlot *slot = &event_ring[seq & (EVENT_RING_SIZE - 1)];
+  __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->event.pin, pin, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->event.edge, edge, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->event.timestamp, timestamp, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->event.sequence, seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&event_head, seq + 1, __ATOMIC_RELEASE);
+}
+
+
+void event_reader_init(EventReader *reader)
+{
+  reader->cursor = __atomic_load_n(&event_head, __ATOMIC_ACQUIRE);
+  reader->dropped = 0;
+}
+
+
+int event_reader_read(EventReader *reader, EdgeEvent *events, int max)
+{
+  int n = 0;
+  while (n < max)
+  {
+    unsigned long long head = __atomic_load_n(&event_head, __ATOMIC_ACQUIRE);
+    if (reader->cursor == head)
+    {
+      break;
+    }
+    if (head - reader->cursor > EVENT_RING_SIZE)
+    {
+      // the producer lapped this reader
+      reader->dropped += head - EVENT_RING_SIZE - reader->cursor;
+      reader->cursor = head - EVENT_RING_SIZE;
+    }
+    EventSlot *slot = &event_ring[reader->cursor & (EVENT_RING_SIZE - 1)];
+    unsigned long long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    EdgeEvent event;
+    event.pin = __atomic_load_n(&slot->event.pin, __ATOMIC_RELAXED);
+    event.edge = __atomic_load_n(&slot->event.edge, __ATOMIC_RELAXED);
+    event.timestamp = __atomic_load_n(&slot->event.timestamp, __ATOMIC_RELAXED);
+    event.sequence = __atomic_load_n(&slot->event.sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq == 0 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+      continue;  // the slot is being rewritten, try again
+    }
+    if (seq != reader->cursor + 1)
+    {
+      // overwritten with a newer event before we got to it
+      reader->dropped ++;
+      reader->cursor ++;
+      continue;
+    }
+    events[n ++] = event;
+    reader->cursor ++;
+  }
+  return n;
+}
+
+
+// Software debounce: an edge is only passed on once the line has stayed at
+// the new level for the settle window. Edges within the window restart it,
+// and a burst that settles back to the old level is dropped as a glitch.
+// The old level is seeded from the line when it is requested.
+
+void debounce_init(Debouncer *d, unsigned long long settle_ns)
+{
+  memset(d, 0, sizeof(Debouncer));
+  d->settle_ns = settle_ns;
+  d->stable_level = -1;
+}
+
+
+void debounce_seed(Debouncer *d, struct gpiod_line *line)
+{
+  int level = gpiod_line_get_value(line);
+  d->stable_level = (level < 0) ? -1 : level;
+}
+
+
+// returns the edge of a burst that had already settled before this edge
+// came in (its timestamp in *settled), or 0
+int debounce_feed(Debouncer *d, int edge, unsigned long long timestamp, unsigned long long *settled)
+{
+  int level = (edge == GPIO_RISING_EDGE) ? 1 : 0;
+  int settled_edge = 0;
+  if (d->pending && timestamp >= d->deadline)
+  {
+    settled_edge = debounce_poll(d, timestamp, settled);
+  }
+  if (!d->pending)
+  {
+    d->pending = true;
+    d->burst_edges = 0;
+    d->level_since[0] = d->level_since[1] = 0;
+  }
+  if (d->level_since[level] == 0)
+  {
+    d->level_since[level] = timestamp;
+  }
+  d->burst_edges ++;
+  d->pending_level = level;
+  d->deadline = timestamp + d->settle_ns;
+  return settled_edge;
+}
+
+
+int debounce_poll(Debouncer *d, unsigned long long now, unsigned long long *timestamp)
+{
+  if (!d->pending || now < d->deadline)
+  {
+    return 0;
+  }
+  d->pending = false;
+  if (d->pending_level == d->stable_level)
+  {
+    d->suppressed += d->burst_edges;
+    return 0;
+  }
+  d->stable_level = d->pending_level;
+  d->suppressed += d->burst_edges - 1;
+  d->passed ++;
+  // report the edge where the line first went to the level it settled at
+  *timestamp = d->level_since[d->stable_level];
+  return d->stable_level ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE;
+}
+
+
+unsigned long long get_event_clock_ns(unsigned long long reference)
+{
+  // kernels before 5.7 stamp line events with CLOCK_REALTIME
+  unsigned long long now = get_monotonic_ns();
+  if (reference > now + 1000000000ULL)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+  return now;
+}
+
+
+int monitor_timer_fd = -1;
+
+
+// compiled reflex rules by trigger pin, [0] for rising and [1] for falling
+// edges; written by reflex_load() with the monitor mutex held
+ReflexAction reflex_actions[MONITOR_PINS][2];
+
+
+void emit_edge_locked(MonitorPin *mp, int edge, unsigned long long timestamp)
+{
+  STATS_BEGIN();
+  // reflexes first, they are what is waiting for the edge most urgently
+  ReflexAction *action = &reflex_actions[mp->pin][edge == GPIO_RISING_EDGE ? 0 : 1];
+  if (action->rules > 0)
+  {
+    if (bank_write_outputs(&action->write) < 0)
+    {
+      action->failed ++;
+    }
+    else
+    {
+      action->fired ++;
+      running_stats_add(&action->latency, (double)get_edge_latency_ns(timestamp));
+    }
+  }
+  if ((mp->wait_for & edge) && mp->callback != NULL)
+  {
+    mp->latest_event = edge;
+    mp->latest_timestamp = timestamp;
+    mp->callback(mp);
+  }
+#ifdef VGP_STATS
+  stats_record(STAT_EDGE_DISPATCH, stats_start);
+#endif
+}
+
+
+void poll_debouncers_locked()
+{
+  // pass on settled edges, then arm the timer for the earliest pending one
+  long long next = -1;
+  for (int pin = 1; pin < MONITOR_PINS && monitor_timer_fd != -1; pin ++)
+  {
+    MonitorPin *mp = &monitor_pins[pin];
+    if (mp->line == NULL || !mp->debounce.pending)
+    {
+      continue;
+    }
+    unsigned long long now = get_event_clock_ns(mp->debounce.deadline);
+    unsigned long long timestamp;
+    int edge = debounce_poll(&mp->debounce, now, &timestamp);
+    if (edge != 0)
+    {
+      emit_edge_locked(mp, edge, timestamp);
+    }
+    else if (mp->debounce.pending && (next == -1 || mp->debounce.deadline - now < next))
+    {
+      next = mp->debounce.deadline - now;
+    }
+  }
+  if (monitor_timer_fd != -1)
+  {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next != -1)
+    {
+      next = (next == 0) ? 1 : next;  // a zero it_value would disarm the timer
+      its.it_value.tv_sec = next / 1000000000LL;
+      its.it_value.tv_nsec = next % 1000000000LL;
+    }
+    timerfd_settime(monitor_timer_fd, 0, &its, NULL);
+  }
+}
+
+
+void * monitor_loop(void *p)
+{
+  struct epoll_event ready[MONITOR_PINS];
+  struct gpiod_line_event events[MONITOR_EVENT_BATCH];
+  while (1)
+  {
+    int n = epoll_wait(monitor_epoll_fd, ready, MONITOR_PINS, -1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("Error waiting for GPIO events");
+      return NULL;
+    }
+    for (int i = 0; i < n; i ++)
+    {
+      if (ready[i].data.u32 == MONITOR_WAKEUP)
+      {
+        return NULL;  // woken up by stop_monitor()
+      }
+      if (ready[i].data.u32 == MONITOR_TIMER)
+      {
+        uint64_t expirations;
+        if (read(monitor_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        {
+          perror("Error reading debounce timer");
+        }
+        pthread_mutex_lock(&monitor_mutex);
+        poll_debouncers_locked();
+        pthread_mutex_unlock(&monitor_mutex);
+        continue;
+      }
+      // callbacks run with the (recursive) mutex held, so once
+      // monitor_remove_pin() returns the pin's callback will not run again
+      pthread_mutex_lock(&monitor_mutex);
+      int ch = ready[i].data.u32 >> 8;
+      int ln = ready[i].data.u32 & 0xff;
+      MonitorPin *mp = &monitor_pins[monitor_chips[ch].pins[ln]];
+      if (mp->line != NULL)
+      {
+        int count = gpiod_line_event_read_multiple(mp->line, events, MONITOR_EVENT_BATCH);
+        for (int j = 0; j < count && mp->line != NULL; j ++)
+        {
+          int edge = (events[j].event_type == GPIOD_LINE_EVENT_RISING_EDGE ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE);
+          unsigned long long timestamp = events[j].ts.tv_sec * 1000000000ULL + events[j].ts.tv_nsec;
+          push_edge_event(mp->pin, edge, timestamp);
+          if (mp->debounce.settle_ns > 0)
+          {
+            unsigned long long settled;
+            int settled_edge = debounce_feed(&mp->debounce, edge, timestamp, &settled);
+            if (settled_edge != 0)
+            {
+              emit_edge_locked(mp, settled_edge, settled);
+            }
+          }
+          else
+          {
+            emit_edge_locked(mp, edge, timestamp);
+          }
+        }
+        if (mp->line != NULL && mp->debounce.settle_ns > 0)
+        {
+          poll_debouncers_locked();
+        }
+      }
+      pthread_mutex_unlock(&monitor_mutex);
+    }
+  }
+  return NULL;
+}
+
+
+int start_monitor()
+{
+  if (monitor_epoll_fd != -1)
+  {
+    return 0;
+  }
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&monitor_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  monitor_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  monitor_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+  if (monitor_epoll_fd < 0 || monitor_wakeup_fd < 0)
+  {
+    perror("Error creating monitor");
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = MONITOR_WAKEUP;
+  epoll_ctl(monitor_epoll_fd, EPOLL_CTL_ADD, monitor_wakeup_fd, &ev);
+
+  monitor_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (monitor_timer_fd >= 0)
+  {
+    ev.events = EPOLLIN;
+    ev.data.u32 = MONITOR_TIMER;
+    epoll_ctl(monitor_epoll_fd, EPOLL_CTL_ADD, monitor_timer_fd, &ev);
+  }
+
+  int err = pthread_create(&monitor_thread, NULL, monitor_loop, NULL);
+  if (err != 0)
+  {
+    printf("Can't create monitor thread :[%s]", strerror(err));
+    return -1;
+  }
+  return 0;
+}
+
+
+void stop_monitor()
+{
+  if (monitor_epoll_fd == -1)
+  {
+    return;
+  }
+  uint64_t one = 1;
+  if (write(monitor_wakeup_fd, &one, sizeof(one)) == sizeof(one))
+  {
+    pthread_join(monitor_thread, NULL);
+  }
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    monitor_remove_pin(pin);
+  }
+  if (monitor_timer_fd != -1)
+  {
+    close(monitor_timer_fd);
+    monitor_timer_fd = -1;
+  }
+  close(monitor_wakeup_fd);
+  close(monitor_epoll_fd);
+  monitor_wakeup_fd = -1;
+  monitor_epoll_fd = -1;
+}
+
+
+// edge events are requested line by line, so that adding or removing a pin
+// leaves the event fds of the chip's other lines, and their queued edges, alone
+int request_line_events_locked(int ch, int ln)
+{
+  MonitorChip *mc = &monitor_chips[ch];
+  struct gpiod_line *line = gpiod_chip_get_line(mc->chip, ln);
+  if (!line)
+  {
+    perror("Error getting GPIO line");
+    return -1;
+  }
+  if (gpiod_line_request_both_edges_events(line, "vgplib") < 0)
+  {
+    perror("Error requesting GPIO line events");
+    return -1;
+  }
+  int fd = gpiod_line_event_get_fd(line);
+  // a stale epoll event after a release must not block the monitor
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLPRI;
+  ev.data.u32 = (ch << 8) | ln;
+  epoll_ctl(monitor_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  monitor_pins[mc->pins[ln]].line = line;
+  debounce_seed(&monitor_pins[mc->pins[ln]].debounce, line);
+  return 0;
+}
+
+
+void release_line_events_locked(int ch, int ln)
+{
+  MonitorPin *mp = &monitor_pins[monitor_chips[ch].pins[ln]];
+  if (mp->line != NULL)
+  {
+    epoll_ctl(monitor_epoll_fd, EPOLL_CTL_DEL, gpiod_line_event_get_fd(mp->line), NULL);
+    gpiod_line_release(mp->line);
+    mp->line = NULL;
+  }
+}
+
+
+int monitor_add_pin(int pin, int wait_for, void (*callback)(void*))
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin))
+  {
+    fprintf(stderr, "Pin %d can not be monitored\n", pin);
+    return -1;
+  }
+  if (wait_for < GPIO_RISING_EDGE || wait_for > GPIO_BOTH_EDGES)
+  {
+    fprintf(stderr, "Unknown edge %d\n", wait_for);
+    return -1;
+  }
+  if (start_monitor() < 0)
+  {
+    return -1;
+  }
+
+  char * pin_name = (char *)NAMES[pin];
+  int ch = get_chip_number(pin_name);
+  int ln = get_line_number(pin_name);
+  flush_register_batch();
+
+  pthread_mutex_lock(&monitor_mutex);
+  MonitorChip *mc = &monitor_chips[ch];
+  if (mc->chip == NULL)
+  {
+    mc->chip = open_chip(ch);
+    if (mc->chip == NULL)
+    {
+      perror("Error opening GPIO chip");
+      pthread_mutex_unlock(&monitor_mutex);
+      return -1;
+    }
+  }
+  release_cached_line(ch, ln);
+
+  // the chip's lines are requested for both edges, wait_for filters them
+  MonitorPin *mp = &monitor_pins[pin];
+  mp->pin = pin;
+  mp->wait_for = wait_for;
+  mp->latest_event = 0;
+  mp->latest_timestamp = 0;
+  mp->callback = callback;
+  debounce_init(&mp->debounce, mp->debounce.settle_ns);
+  if (mp->line != NULL)
+  {
+    debounce_seed(&mp->debounce, mp->line);
+  }
+  bool added = (mc->pins[ln] == 0);
+  mc->pins[ln] = pin;
+  int ret = 0;
+  if (added && request_line_events_locked(ch, ln) < 0)
+  {
+    mc->pins[ln] = 0;
+    ret = -1;
+  }
+  pthread_mutex_unlock(&monitor_mutex);
+  return ret;
+}
+
+
+int monitor_remove_pin(int pin)
+{
+  if (monitor_epoll_fd == -1 || pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin))
+  {
+    return -1;
+  }
+  char * pin_name = (char *)NAMES[pin];
+  int ch = get_chip_number(pin_name);
+  int ln = get_line_number(pin_name);
+  flush_register_batch();
+
+  pthread_mutex_lock(&monitor_mutex);
+  MonitorChip *mc = &monitor_chips[ch];
+  if (mc->pins[ln] != 0)
+  {
+    release_line_events_locked(ch, ln);
+    mc->pins[ln] = 0;
+    int monitored = 0;
+    for (int i = 0; i < 32; i ++)
+    {
+      monitored += (mc->pins[i] != 0);
+    }
+    if (monitored == 0)
+    {
+      gpiod_chip_close(mc->chip);
+      mc->chip = NULL;
+    }
+  }
+  pthread_mutex_unlock(&monitor_mutex);
+  return 0;
+}
+
+
+unsigned long long get_monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+long long get_edge_latency_ns(unsigned long long timestamp)
+{
+  return (long long)(get_event_clock_ns(timestamp) - timestamp);
+}
+
+
+int edge_waiter_open(EdgeWaiter *waiter, int pin, int wait_for)
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin))
+  {
+    fprintf(stderr, "Pin %d can not be monitored\n", pin);
+    return -1;
+  }
+  char * pin_name = (char *)NAMES[pin];
+  int ch = get_chip_number(pin_name);
+  int ln = get_line_number(pin_name);
+  flush_register_batch();
+  waiter->pin = pin;
+  waiter->wait_for = wait_for;
+  debounce_init(&waiter->debounce, 0);
+  waiter->chip = open_chip(ch);
+  if (!waiter->chip)
+  {
+    perror("Error opening GPIO chip");
+    return -1;
+  }
+  release_cached_line(ch, ln);
+  waiter->line = gpiod_chip_get_line(waiter->chip, ln);
+  int ret = -1;
+  if (waiter->line)
+  {
+    switch (wait_for)
+    {
+      case GPIO_RISING_EDGE:
+        ret = gpiod_line_request_rising_edge_events(waiter->line, "vgplib");
+        break;
+      case GPIO_FALLING_EDGE:
+        ret = gpiod_line_request_falling_edge_events(waiter->line, "vgplib");
+        break;
+      case GPIO_BOTH_EDGES:
+        ret = gpiod_line_request_both_edges_events(waiter->line, "vgplib");
+        break;
+    }
+  }
+  if (ret < 0)
+  {
+    perror("Error requesting GPIO line events");
+    gpiod_chip_close(waiter->chip);
+    waiter->chip = NULL;
+    waiter->line = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+int edge_waiter_set_debounce(EdgeWaiter *waiter, unsigned int settle_us)
+{
+  // the debouncer needs to see both edges to follow the line level
+  if (waiter->wait_for != GPIO_BOTH_EDGES)
+  {
+    gpiod_line_release(waiter->line);
+    if (gpiod_line_request_both_edges_events(waiter->line, "vgplib") < 0)
+    {
+      perror("Error requesting GPIO line events");
+      return -1;
+    }
+  }
+  debounce_init(&waiter->debounce, settle_us * 1000ULL);
+  debounce_seed(&waiter->debounce, waiter->line);
+  return 0;
+}
+
+
+int edge_waiter_wait(EdgeWaiter *waiter, int timeout_ms, EdgeEvent *event)
+{
+  Debouncer *d = &waiter->debounce;
+  unsigned long long deadline = get_monotonic_ns() + timeout_ms * 1000000ULL;
+  struct pollfd pfd;
+  pfd.fd = gpiod_line_event_get_fd(waiter->line);
+  pfd.events = POLLIN | POLLPRI;
+  int edge;
+  unsigned long long timestamp = 0;
+  while (1)
+  {
+    edge = 0;
+    if (d->pending)
+    {
+      edge = debounce_poll(d, get_event_clock_ns(d->deadline), &timestamp);
+    }
+    if (edge & waiter->wait_for)
+    {
+      break;
+    }
+    // a line that keeps bouncing must not hold the wait past its timeout
+    int wait_ms = timeout_ms;
+    if (timeout_ms >= 0)
+    {
+      unsigned long long now = get_monotonic_ns();
+      if (now >= deadline)
+      {
+        return 0;
+      }
+      wait_ms = (deadline - now + 999999) / 1000000;
+    }
+    if (d->pending)
+    {
+      // wake up when the pending edge would settle
+      unsigned long long now = get_event_clock_ns(d->deadline);
+      int settle_ms = (now >= d->deadline) ? 0 : (d->deadline - now + 999999) / 1000000;
+      if (wait_ms < 0 || settle_ms < wait_ms)
+      {
+        wait_ms = settle_ms;
+      }
+    }
+    int ret = poll(&pfd, 1, wait_ms);
+    if (ret < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 0)
+    {
+      continue;
+    }
+    struct gpiod_line_event ev;
+    if (gpiod_line_event_read(waiter->line, &ev) < 0)
+    {
+      perror("Error reading GPIO event");
+      return -1;
+    }
+    edge = (ev.event_type == GPIOD_LINE_EVENT_RISING_EDGE ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE);
+    timestamp = ev.ts.tv_sec * 1000000000ULL + ev.ts.tv_nsec;
+    if (d->settle_ns == 0)
+    {
+      break;
+    }
+    unsigned long long settled;
+    edge = debounce_feed(d, edge, timestamp, &settled);
+    if (edge & waiter->wait_for)
+    {
+      timestamp = settled;
+      break;
+    }
+  }
+  event->pin = waiter->pin;
+  event->edge = edge;
+  event->timestamp = timestamp;
+  event->sequence = 0;
+  return 1;
+}
+
+
+void edge_waiter_close(EdgeWaiter *waiter)
+{
+  if (waiter->chip != NULL)
+  {
+    gpiod_line_release(waiter->line);
+    gpiod_chip_close(waiter->chip);
+    waiter->chip = NULL;
+    waiter->line = NULL;
+  }
+}
+
+
+bool is_pin_monitored(int pin)
+{
+  return pin > 0 && pin < MONITOR_PINS && monitor_pins[pin].line != NULL;
+}
+
+
+int monitor_set_debounce(int pin, unsigned int settle_us)
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin))
+  {
+    return -1;
+  }
+  if (start_monitor() < 0)
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&monitor_mutex);
+  debounce_init(&monitor_pins[pin].debounce, settle_us * 1000ULL);
+  if (monitor_pins[pin].line != NULL)
+  {
+    debounce_seed(&monitor_pins[pin].debounce, monitor_pins[pin].line);
+  }
+  pthread_mutex_unlock(&monitor_mutex);
+  return 0;
+}
+
+
+// Logic analyzer capture. The ring keeps the newest changes; before the
+// trigger old entries are overwritten, after it the capture stops rather
+// than overwrite anything inside the pre trigger window.
+
+int capture_event_fd = -1;
+
+
+void on_capture_event(void *p)
+{
+  uint64_t one = 1;
+  if (write(capture_event_fd, &one, sizeof(one)) < 0)
+  {
+    perror("Error signalling capture");
+  }
+}
+
+
+int capture_init(Capture *cap, const Bus *bus, int capacity)
+{
+  memset(cap, 0, sizeof(Capture));
+  if (capacity < 2)
+  {
+    fprintf(stderr, "Capture buffer needs at least 2 samples\n");
+    return -1;
+  }
+  cap->bus = bus;
+  cap->mode = CAPTURE_SAMPLED;
+  cap->trigger_bit = -1;
+  cap->trigger_edge = GPIO_BOTH_EDGES;
+  cap->ring = malloc(capacity * sizeof(CaptureSample));
+  if (cap->ring == NULL)
+  {
+    perror("Can not allocate capture buffer");
+    return -1;
+  }
+  // fault the pages in now rather than inside the capture loop
+  memset(cap->ring, 0, capacity * sizeof(CaptureSample));
+  cap->capacity = capacity;
+  return 0;
+}
+
+
+void capture_free(Capture *cap)
+{
+  free(cap->ring);
+  cap->ring = NULL;
+  cap->capacity = 0;
+}
+
+
+unsigned long long capture_window_start(const Capture *cap)
+{
+  return (cap->trigger > cap->pre_ns) ? cap->trigger - cap->pre_ns : 0;
+}
+
+
+bool capture_push(Capture *cap, unsigned long long timestamp, unsigned int word)
+{
+  if (cap->count == cap->capacity)
+  {
+    if (cap->trigger != 0 && cap->ring[cap->head].timestamp >= capture_window_start(cap))
+    {
+      cap->truncated = true;
+      return false;
+    }
+    cap->head = (cap->head + 1) % cap->capacity;
+    cap->count --;
+  }
+  CaptureSample *s = &cap->ring[(cap->head + cap->count) % cap->capacity];
+  s->timestamp = timestamp;
+  s->word = word;
+  cap->count ++;
+  return true;
+}
+
+
+void capture_check_trigger(Capture *cap, unsigned int last, unsigned int word, unsigned long long timestamp)
+{
+  if (cap->trigger != 0 || (((last ^ word) >> cap->trigger_bit) & 0x01) == 0)
+  {
+    return;
+  }
+  int edge = ((word >> cap->trigger_bit) & 0x01) ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE;
+  if (cap->trigger_edge & edge)
+  {
+    cap->trigger = timestamp;
+  }
+}
+
+
+bool capture_done(const Capture *cap, unsigned long long now, unsigned long long deadline)
+{
+  if (cap->trigger != 0)
+  {
+    return now - cap->trigger >= cap->post_ns;
+  }
+  return deadline != 0 && now >= deadline;
+}
+
+
+int capture_sampled(Capture *cap, unsigned long long deadline)
+{
+  unsigned int last, word;
+  if (bus_read(cap->bus, &last) < 0)
+  {
+    return -1;
+  }
+  unsigned long long now = get_monotonic_ns();
+  capture_push(cap, now, last);
+  cap->trigger = (cap->trigger_bit < 0) ? now : 0;
+  while (!capture_done(cap, now = get_monotonic_ns(), deadline))
+  {
+    if (bus_read(cap->bus, &word) < 0)
+    {
+      return -1;
+    }
+    cap->polls ++;
+    if (word != last)
+    {
+      capture_check_trigger(cap, last, word, now);
+      if (!capture_push(cap, now, word))
+      {
+        break;
+      }
+      last = word;
+    }
+  }
+  return 0;
+}
+
+
+int capture_edges(Capture *cap, unsigned long long deadline)
+{
+  const Bus *bus = cap->bus;
+  int bits[MONITOR_PINS];
+  bool added[BUS_MAX_PINS];
+  for (int pin = 0; pin < MONITOR_PINS; pin ++)
+  {
+    bits[pin] = -1;
+  }
+  capture_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (capture_event_fd < 0)
+  {
+    perror("Can not create capture eventfd");
+    return -1;
+  }
+  EventReader reader;
+  event_reader_init(&reader);
+  int ret = 0;
+  for (int bit = 0; bit < bus->width; bit ++)
+  {
+    int pin = bus->pins[bit];
+    bits[pin] = bit;
+    // pins monitored by someone else are still seen through the ring
+    added[bit] = !is_pin_monitored(pin);
+    if (added[bit] && monitor_add_pin(pin, GPIO_BOTH_EDGES, on_capture_event) < 0)
+    {
+      added[bit] = false;
+      ret = -1;
+    }
+  }
+
+  unsigned int last;
+  if (ret == 0 && bus_read(bus, &last) < 0)
+  {
+    ret = -1;
+  }
+  unsigned long long now = get_monotonic_ns();
+  long long clock_offset = 0;
+  bool offset_known = false;
+  if (ret == 0)
+  {
+    capture_push(cap, now, last);
+    cap->trigger = (cap->trigger_bit < 0) ? now : 0;
+  }
+  struct pollfd pfd = { capture_event_fd, POLLIN, 0 };
+  while (ret == 0 && !capture_done(cap, now, deadline))
+  {
+    // also wake up now and then for pins whose callback is not ours
+    unsigned long long until = (cap->trigger != 0) ? cap->trigger + cap->post_ns : deadline;
+    int wait_ms = 100;
+    if (until != 0 && (until - now) / 1000000 < wait_ms)
+    {
+      wait_ms = (until - now + 999999) / 1000000;
+    }
+    poll(&pfd, 1, wait_ms);
+    uint64_t count;
+    if (read(capture_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+      ret = -1;
+    }
+
+    EdgeEvent events[MONITOR_EVENT_BATCH];
+    int n;
+    bool stop = false;
+    while (!stop && (n = event_reader_read(&reader, events, MONITOR_EVENT_BATCH)) > 0)
+    {
+      if (!offset_known)
+      {
+        // event timestamps may be CLOCK_REALTIME on old kernels
+        clock_offset = (long long)(get_event_clock_ns(events[0].timestamp) - get_monotonic_ns());
+        offset_known = true;
+      }
+      for (int i = 0; i < n && !stop; i ++)
+      {
+        int bit = (events[i].pin > 0 && events[i].pin < MONITOR_PINS) ? bits[events[i].pin] : -1;
+        if (bit < 0)
+        {
+          continue;
+        }
+        cap->polls ++;
+        unsigned long long t = events[i].timestamp - clock_offset;
+        if (capture_done(cap, t, 0))
+        {
+          stop = true;
+          break;
+        }
+        unsigned int word = (events[i].edge == GPIO_RISING_EDGE) ? (last | (1u << bit)) : (last & ~(1u << bit));
+        if (word != last)
+        {
+          capture_check_trigger(cap, last, word, t);
+          stop = !capture_push(cap, t, word);
+          last = word;
+        }
+      }
+    }
+    if (stop)
+    {
+      break;
+    }
+    now = get_monotonic_ns();
+  }
+  cap->lost = reader.dropped;
+
+  for (int bit = 0; bit < bus->width; bit ++)
+  {
+    if (added[bit])
+    {
+      monitor_remove_pin(bus->pins[bit]);
+    }
+  }
+  close(capture_event_fd);
+  capture_event_fd = -1;
+  return ret;
+}
+
+
+// returns 1 when the window was captured, 0 if the trigger timed out
+int capture_run(Capture *cap, int timeout_ms)
+{
+  cap->head = 0;
+  cap->count = 0;
+  cap->trigger = 0;
+  cap->polls = 0;
+  cap->lost = 0;
+  cap->truncated = false;
+  unsigned long long deadline = (timeout_ms >= 0) ? get_monotonic_ns() + timeout_ms * 1000000ULL : 0;
+  int ret = (cap->mode == CAPTURE_EDGES) ? capture_edges(cap, deadline) : capture_sampled(cap, deadline);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (cap->trigger == 0)
+  {
+    cap->start = (cap->count > 0) ? cap->ring[cap->head].timestamp : 0;
+    return 0;
+  }
+  // drop what is older than the window, but keep the level at its start
+  cap->start = capture_window_start(cap);
+  while (cap->count > 1 && cap->ring[(cap->head + 1) % cap->capacity].timestamp <= cap->start)
+  {
+    cap->head = (cap->head + 1) % cap->capacity;
+    cap->count --;
+  }
+  return 1;
+}
+
+
+void capture_get(const Capture *cap, int i, CaptureSample *sample)
+{
+  *sample = cap->ring[(cap->head + i) % cap->capacity];
+  if (sample->timestamp < cap->start)
+  {
+    sample->timestamp = cap->start;
+  }
+}
+
+
+int capture_write_vcd(const Capture *cap, FILE *f)
+{
+  const Bus *bus = cap->bus;
+  fprintf(f, "$version vgp %.2f $end\n", VGP_VERSION);
+  if (cap->trigger != 0)
+  {
+    fprintf(f, "$comment trigger at %llu $end\n", cap->trigger - cap->start);
+  }
+  fprintf(f, "$timescale 1ns $end\n");
+  fprintf(f, "$scope module %s $end\n", bus->name != NULL ? bus->name : "vgp");
+  for (int bit = 0; bit < bus->width; bit ++)
+  {
+    // identifiers are single printable characters starting at '!'
+    fprintf(f, "$var wire 1 %c %s $end\n", '!' + bit, NAMES[bus->pins[bit]]);
+  }
+  fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+  unsigned int last = 0;
+  for (int i = 0; i < cap->count; i ++)
+  {
+    CaptureSample s;
+    capture_get(cap, i, &s);
+    unsigned int changed = (i == 0) ? 0xffffffff : (s.word ^ last);
+    fprintf(f, "#%llu\n", s.timestamp - cap->start);
+    if (i == 0)
+    {
+      fprintf(f, "$dumpvars\n");
+    }
+    for (int bit = 0; bit < bus->width; bit ++)
+    {
+      if ((changed >> bit) & 0x01)
+      {
+        fprintf(f, "%u%c\n", (s.word >> bit) & 0x01, '!' + bit);
+      }
+    }
+    if (i == 0)
+    {
+      fprintf(f, "$end\n");
+    }
+    last = s.word;
+  }
+  return ferror(f) ? -1 : 0;
+}
+
+
+// binary capture: CAPTURE_MAGIC\0, u32 width, u32 count, u64 trigger offset
+// (ns, ~0 if none), width bytes of header pin numbers, then count records
+// of u64 time offset (ns) and u32 word, little endian without padding
+int capture_write_binary(const Capture *cap, FILE *f)
+{
+  unsigned int width = cap->bus->width;
+  unsigned int count = cap->count;
+  unsigned long long trigger = (cap->trigger != 0) ? cap->trigger - cap->start : ~0ULL;
+  fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), f);
+  fwrite(&width, sizeof(width), 1, f);
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(&trigger, sizeof(trigger), 1, f);
+  for (int bit = 0; bit < width; bit ++)
+  {
+    fputc(cap->bus->pins[bit], f);
+  }
+  for (int i = 0; i < cap->count; i ++)
+  {
+    CaptureSample s;
+    capture_get(cap, i, &s);
+    unsigned long long offset = s.timestamp - cap->start;
+    fwrite(&offset, sizeof(offset), 1, f);
+    fwrite(&s.word, sizeof(s.word), 1, f);
+  }
+  return ferror(f) ? -1 : 0;
+}
+
+
+void running_stats_reset(RunningStats *stats)
+{
+  memset(stats, 0, sizeof(RunningStats));
+}
+
+
+void running_stats_add(RunningStats *stats, double value)
+{
+  // Welford's update, stable for long runs
+  if (stats->count == 0 || value < stats->min)
+  {
+    stats->min = value;
+  }
+  if (stats->count == 0 || value > stats->max)
+  {
+    stats->max = value;
+  }
+  stats->count ++;
+  double delta = value - stats->mean;
+  stats->mean += delta / stats->count;
+  stats->m2 += delta * (value - stats->mean);
+}
+
+
+void running_stats_merge(RunningStats *stats, const RunningStats *other)
+{
+  if (other->count == 0)
+  {
+    return;
+  }
+  if (stats->count == 0)
+  {
+    *stats = *other;
+    return;
+  }
+  double count = stats->count + other->count;
+  double delta = other->mean - stats->mean;
+  stats->m2 += other->m2 + delta * delta * stats->count * other->count / count;
+  stats->mean += delta * other->count / count;
+  stats->min = (other->min < stats->min) ? other->min : stats->min;
+  stats->max = (other->max > stats->max) ? other->max : stats->max;
+  stats->count += other->count;
+}
+
+
+double running_stats_stddev(const RunningStats *stats)
+{
+  return (stats->count > 1) ? sqrt(stats->m2 / (stats->count - 1)) : 0;
+}
+
+
+volatile sig_atomic_t sequence_stopped = 0;
+
+
+void sequence_init(Sequence *seq)
+{
+  memset(seq, 0, sizeof(Sequence));
+}
+
+
+void sequence_free(Sequence *seq)
+{
+  free(seq->steps);
+  sequence_init(seq);
+}
+
+
+int sequence_add_step(Sequence *seq, unsigned long long offset_ns, const BankWrite *write)
+{
+  if (seq->count > 0 && offset_ns < seq->steps[seq->count - 1].offset_ns)
+  {
+    fprintf(stderr, "Sequence steps must be in time order\n");
+    return -1;
+  }
+  if (seq->count == seq->capacity)
+  {
+    int capacity = (seq->capacity == 0) ? 16 : seq->capacity * 2;
+    SequenceStep *steps = realloc(seq->steps, capacity * sizeof(SequenceStep));
+    if (steps == NULL)
+    {
+      perror("Can not grow sequence");
+      return -1;
+    }
+    seq->steps = steps;
+    seq->capacity = capacity;
+  }
+  SequenceStep *step = &seq->steps[seq->count ++];
+  step->offset_ns = offset_ns;
+  step->write = *write;
+  running_stats_reset(&step->lateness);
+  return 0;
+}
+
+
+// safe to call from a signal handler, the current step is not played
+void sequence_stop()
+{
+  sequence_stopped = 1;
+}
+
+
+// plays the sequence loops times (0 loops until sequence_stop()),
+// returns the number of steps played
+int sequence_play(Sequence *seq, int loops, RunningStats *lateness)
+{
+  running_stats_reset(lateness);
+  if (seq->count == 0)
+  {
+    fprintf(stderr, "The sequence has no steps\n");
+    return -1;
+  }
+  unsigned long long last = seq->steps[seq->count - 1].offset_ns;
+  unsigned long long period = seq->period_ns;
+  if (period == 0 && seq->count > 1)
+  {
+    // the last level lasts as long as the step before it
+    period = 2 * last - seq->steps[seq->count - 2].offset_ns;
+  }
+  // the last step must not share its deadline with the next loop's first
+  if (period <= last && (loops != 1 || seq->period_ns != 0))
+  {
+    fprintf(stderr, "The period has to be longer than the last step (%.3f ms)\n", last / 1e6);
+    return -1;
+  }
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("Can not create timer");
+    return -1;
+  }
+  for (int i = 0; i < seq->count; i ++)
+  {
+    running_stats_reset(&seq->steps[i].lateness);
+  }
+  sequence_stopped = 0;
+  bool batched = suspend_register_batch();  // every step has to reach the pins at once
+  int played = 0;
+  unsigned long long start = get_monotonic_ns() + SEQUENCE_START_DELAY_NS;
+  for (int loop = 0; (loops == 0 || loop < loops) && !sequence_stopped; loop ++)
+  {
+    for (int i = 0; i < seq->count && !sequence_stopped; i ++)
+    {
+      SequenceStep *step = &seq->steps[i];
+      // absolute deadlines, so lateness of one step does not shift the next
+      unsigned long long deadline = start + loop * period + step->offset_ns;
+      struct itimerspec its;
+      memset(&its, 0, sizeof(its));
+      its.it_value.tv_sec = deadline / 1000000000ULL;
+      its.it_value.tv_nsec = deadline % 1000000000ULL;
+      uint64_t expirations;
+      if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      {
+        perror("Can not set timer");
+        played = -1;
+        break;
+      }
+      while (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EINTR && !sequence_stopped);
+      if (sequence_stopped)
+      {
+        break;
+      }
+      if (bank_write_apply(&step->write) < 0)
+      {
+        played = -1;
+        break;
+      }
+      running_stats_add(&step->lateness, (double)(get_monotonic_ns() - deadline));
+      played ++;
+    }
+    if (played < 0)
+    {
+      break;
+    }
+  }
+  close(fd);
+  resume_register_batch(batched);
+  for (int i = 0; i < seq->count; i ++)
+  {
+    running_stats_merge(lateness, &seq->steps[i].lateness);
+  }
+  return played;
+}
+
+
+// Software PWM. The heap holds the channels ordered by their next edge;
+// channels with a constant level (0% or 100%) are not in it.
+
+PwmChannel pwm_channels[MONITOR_PINS];
+
+PwmChannel * pwm_heap[MONITOR_PINS];
+
+int pwm_heap_size = 0;
+
+pthread_mutex_t pwm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_cond_t pwm_cond;
+
+pthread_t pwm_thread;
+
+bool pwm_running = false;
+
+
+void pwm_heap_swap(int a, int b)
+{
+  PwmChannel *tmp = pwm_heap[a];
+  pwm_heap[a] = pwm_heap[b];
+  pwm_heap[b] = tmp;
+  pwm_heap[a]->heap_index = a;
+  pwm_heap[b]->heap_index = b;
+}
+
+
+void pwm_heap_sift(int i)
+{
+  while (i > 0 && pwm_heap[i]->next_ns < pwm_heap[(i - 1) / 2]->next_ns)
+  {
+    pwm_heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (true)
+  {
+    int smallest = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < pwm_heap_size && pwm_heap[left]->next_ns < pwm_heap[smallest]->next_ns)
+    {
+      smallest = left;
+    }
+    if (right < pwm_heap_size && pwm_heap[right]->next_ns < pwm_heap[smallest]->next_ns)
+    {
+      smallest = right;
+    }
+    if (smallest == i)
+    {
+      break;
+    }
+    pwm_heap_swap(i, smallest);
+    i = smallest;
+  }
+}
+
+
+void pwm_heap_push(PwmChannel *pc)
+{
+  pc->heap_index = pwm_heap_size;
+  pwm_heap[pwm_heap_size ++] = pc;
+  pwm_heap_sift(pc->heap_index);
+}
+
+
+void pwm_heap_remove(PwmChannel *pc)
+{
+  int i = pc->heap_index;
+  if (i < 0)
+  {
+    return;
+  }
+  pwm_heap_swap(i, -- pwm_heap_size);
+  pc->heap_index = -1;
+  if (i < pwm_heap_size)
+  {
+    pwm_heap_sift(i);
+  }
+}
+
+
+void * pwm_loop(void *arg)
+{
+  pthread_mutex_lock(&pwm_mutex);
+  while (pwm_running)
+  {
+    if (pwm_heap_size == 0)
+    {
+      pthread_cond_wait(&pwm_cond, &pwm_mutex);
+      continue;
+    }
+    unsigned long long due = pwm_heap[0]->next_ns;
+    if (get_monotonic_ns() + PWM_TICK_NS / 2 < due)
+    {
+      // woken early when channels change
+      struct timespec ts;
+      ts.tv_sec = due / 1000000000ULL;
+      ts.tv_nsec = due % 1000000000ULL;
+      pthread_cond_timedwait(&pwm_cond, &pwm_mutex, &ts);
+      continue;
+    }
+
+    // collect every edge of this tick, on all banks
+    BankWrite levels;
+    bank_write_init(&levels);
+    PwmChannel *batch[MONITOR_PINS];
+    int count = 0;
+    while (pwm_heap_size > 0 && pwm_heap[0]->next_ns <= due + PWM_TICK_NS)
+    {
+      PwmChannel *pc = pwm_heap[0];
+      pwm_heap_remove(pc);
+      pc->level = !pc->level;
+      bank_write_add(&levels, pc->ch, pc->ln, pc->level);
+      batch[count ++] = pc;
+    }
+    if (bank_write_outputs(&levels) < 0)
+    {
+      fprintf(stderr, "PWM register write failed\n");
+    }
+    unsigned long long now = get_monotonic_ns();
+
+    for (int i = 0; i < count; i ++)
+    {
+      PwmChannel *pc = batch[i];
+      unsigned long long edge = pc->next_ns;
+      running_stats_add(&pc->lateness, (double)(long long)(now - edge));  // negative when written early in the tick
+      if (pc->level)
+      {
+        if (pc->periods ++ == 0)
+        {
+          pc->first_rise = now;
+        }
+        pc->last_rise = now;
+      }
+      pc->next_ns = edge + (pc->level ? pc->high_ns : pc->period_ns - pc->high_ns);
+      if (pc->level == 0 && pc->next_ns + pc->period_ns < now)
+      {
+        // more than a period behind: keep the phase but drop the missed periods
+        unsigned long long missed = (now - pc->next_ns) / pc->period_ns;
+        pc->next_ns += missed * pc->period_ns;
+        pc->skipped += missed;
+      }
+      pwm_heap_push(pc);
+    }
+  }
+  pthread_mutex_unlock(&pwm_mutex);
+  return NULL;
+}
+
+
+int start_pwm_thread()
+{
+  if (pwm_running)
+  {
+    return 0;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pwm_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  for (int pin = 0; pin < MONITOR_PINS; pin ++)
+  {
+    pwm_channels[pin].heap_index = -1;
+  }
+  pwm_running = true;
+  // signals are for the application's threads
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&pwm_thread, NULL, pwm_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0)
+  {
+    printf("Can't create PWM thread :[%s]", strerror(err));
+    pwm_running = false;
+    return -1;
+  }
+  return 0;
+}
+
+
+// duty is 0..1, the pin must already be an output
+int pwm_start(int pin, double frequency, double duty)
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || is_power_pin(pin) || frequency <= 0 || frequency > 1e9 / (2 * PWM_TICK_NS)
+    || duty < 0 || duty > 1)
+  {
+    fprintf(stderr, "Can not run PWM at %g Hz, duty %g on pin %d\n", frequency, duty, pin);
+    return -1;
+  }
+  char * pin_name = (char *)NAMES[pin];
+  int ch = get_chip_number(pin_name);
+  int ln = get_line_number(pin_name);
+  if (get_dir(ch, ln) != GPIO_OUTPUT)
+  {
+    fprintf(stderr, "Pin %d (%s) is not an output\n", pin, pin_name);
+    return -1;
+  }
+  flush_register_batch();
+  if (start_pwm_thread() < 0)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&pwm_mutex);
+  PwmChannel *pc = &pwm_channels[pin];
+  pwm_heap_remove(pc);
+  memset(pc, 0, sizeof(PwmChannel));
+  pc->pin = pin;
+  pc->ch = ch;
+  pc->ln = ln;
+  pc->heap_index = -1;
+  pc->period_ns = (unsigned long long)(1e9 / frequency + 0.5);
+  pc->high_ns = (unsigned long long)(pc->period_ns * duty + 0.5);
+  running_stats_reset(&pc->lateness);
+  int ret = 0;
+  if (pc->high_ns < PWM_TICK_NS / 2 || pc->period_ns - pc->high_ns < PWM_TICK_NS / 2)
+  {
+    // too short to be scheduled, hold the nearer constant level instead
+    BankWrite level;
+    bank_write_init(&level);
+    bank_write_add(&level, ch, ln, pc->high_ns >= PWM_TICK_NS / 2);
+    ret = bank_write_outputs(&level);
+  }
+  else
+  {
+    // the first edge is rising, on the start grid so that channels started
+    // together share their edges
+    unsigned long long now = get_monotonic_ns() + PWM_TICK_NS;
+    pc->level = 0;
+    pc->next_ns = (now / PWM_START_GRID_NS + 1) * PWM_START_GRID_NS;
+    pwm_heap_push(pc);
+    pthread_cond_signal(&pwm_cond);
+  }
+  pthread_mutex_unlock(&pwm_mutex);
+  return ret;
+}
+
+
+// stops the PWM on the pin and leaves it low
+int pwm_stop(int pin)
+{
+  if (!pwm_running || pin <= 0 || pin >= MONITOR_PINS)
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&pwm_mutex);
+  PwmChannel *pc = &pwm_channels[pin];
+  int ret = 0;
+  if (pc->pin == pin)
+  {
+    pwm_heap_remove(pc);
+    BankWrite low;
+    bank_write_init(&low);
+    bank_write_add(&low, pc->ch, pc->ln, 0);
+    ret = bank_write_outputs(&low);
+  }
+  pthread_mutex_unlock(&pwm_mutex);
+  return ret;
+}
+
+
+void pwm_shutdown()
+{
+  if (!pwm_running)
+  {
+    return;
+  }
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    if (pwm_channels[pin].pin == pin)
+    {
+      pwm_stop(pin);
+    }
+  }
+  pthread_mutex_lock(&pwm_mutex);
+  pwm_running = false;
+  pthread_cond_signal(&pwm_cond);
+  pthread_mutex_unlock(&pwm_mutex);
+  pthread_join(pwm_thread, NULL);
+  pthread_cond_destroy(&pwm_cond);
+}
+
+
+int pwm_get_stats(int pin, PwmChannel *stats)
+{
+  if (pin <= 0 || pin >= MONITOR_PINS || pwm_channels[pin].pin != pin)
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&pwm_mutex);
+  *stats = pwm_channels[pin];
+  pthread_mutex_unlock(&pwm_mutex);
+  return 0;
+}
+
+
+double pwm_achieved_frequency(const PwmChannel *stats)
+{
+  if (stats->periods < 2 || stats->last_rise == stats->first_rise)
+  {
+    return 0;
+  }
+  return (stats->periods - 1) * 1e9 / (stats->last_rise - stats->first_rise);
 }
 
 
-int set_register(unsigned int address, unsigned int value)
+// Pulse meter: only the latest edge times and running statistics are kept,
+// so windows of any length take the same memory.
+
+void pulse_meter_init(PulseMeter *meter)
 {
-    sprintf(command_buffer, "sudo io -4 -w 0x%x 0x%x", address, value);
-    int length = run_command(command_buffer);
-    if (length < 0)
+  memset(meter, 0, sizeof(PulseMeter));
+  pulse_meter_next_window(meter);
+}
+
+
+void pulse_meter_feed(PulseMeter *meter, int edge, unsigned long long timestamp)
+{
+  meter->edges ++;
+  if (edge == GPIO_RISING_EDGE)
+  {
+    // a repeated edge means one in between was lost, the width is unknown,
+    // and so is the period unless the edges since the last rise were paired
+    if (meter->last_edge == GPIO_FALLING_EDGE && timestamp > meter->last_fall)
     {
-      printf("set_register returned an error\n");
+      running_stats_add(&meter->low, timestamp - meter->last_fall);
+      if (meter->fall_after_rise && timestamp > meter->last_rise)
+      {
+        running_stats_add(&meter->period, timestamp - meter->last_rise);
+      }
     }
-    return length;
+    meter->last_rise = timestamp;
+  }
+  else
+  {
+    meter->fall_after_rise = (meter->last_edge == GPIO_RISING_EDGE);
+    if (meter->fall_after_rise && timestamp > meter->last_rise)
+    {
+      running_stats_add(&meter->high, timestamp - meter->last_rise);
+    }
+    meter->last_fall = timestamp;
+  }
+  meter->last_edge = edge;
 }
 
 
-int get_chip_number(char *pin_name)
+// starts a new window, a pulse across the boundary counts in the new one
+void pulse_meter_next_window(PulseMeter *meter)
 {
-  return pin_name[0] - 0x30;
+  running_stats_reset(&meter->period);
+  running_stats_reset(&meter->high);
+  running_stats_reset(&meter->low);
+  meter->edges = 0;
 }
 
 
-int get_line_number(char *pin_name)
+double pulse_meter_frequency(const PulseMeter *meter)
 {
-  return ((pin_name[1] - 0x41) << 3) + (pin_name[2] - 0x30);
+  return (meter->period.count > 0) ? 1e9 / meter->period.mean : 0;
 }
 
 
-int get_dir(int ch, int ln)
+double pulse_meter_duty(const PulseMeter *meter)
 {
-  int group = ln / 8;
-  int index = ln % 8;
-  int gpio_directions = get_register(GPIO_BASE[ch] + GPIO_SWPORTA_DDR);
-  int directions = ((gpio_directions >> (group << 3)) & 0xff);
-  return ((directions & (0x01 << index)) >> index);
+  double cycle = meter->high.mean + meter->low.mean;
+  return (meter->high.count > 0 && meter->low.count > 0 && cycle > 0) ? meter->high.mean / cycle : 0;
 }
 
 
-int set_dir(int ch, int ln, int dir)
+void adc_to_volts(const int * restrict raw, float * restrict volts, int n, float scale)
 {
-  int group = ln / 8;
-  int index = ln % 8;
-  int gpio_directions = get_register(GPIO_BASE[ch] + GPIO_SWPORTA_DDR);
-  int directions = ((gpio_directions >> (group << 3)) & 0xff);
-  if (dir == GPIO_INPUT)
+  for (int i = 0; i < n; i ++)
   {
-    directions &= ~(0x01 << index);
+    volts[i] = raw[i] * scale;
   }
-  else if (dir == GPIO_OUTPUT)
+}
+
+
+int boxcar_init(BoxcarFilter *filter, int length)
+{
+  if (length < 1 || length > BOXCAR_MAX_LENGTH)
   {
-    directions |= (0x01 << index);
+    fprintf(stderr, "Moving average length must be 1 to %d\n", BOXCAR_MAX_LENGTH);
+    return -1;
   }
-  else
+  memset(filter, 0, sizeof(BoxcarFilter));
+  filter->length = length;
+  return 0;
+}
+
+
+// out[i] is the mean of in[i - length + 1] .. in[i], from a running sum of
+// the raw counts. Integer sums are exact, so the sum does not drift however
+// long the stream runs, and the cost per sample does not depend on length.
+void boxcar_process(BoxcarFilter *filter, const int *in, float *out, int n)
+{
+  int taps = filter->length;
+  float scale = 1.0f / taps;
+  if (n > 0 && !filter->primed)
   {
-    fprintf(stderr, "Unknown direction %d\n", dir);
-    return -3;
+    // start as if the first sample had been there all along
+    for (int i = 0; i < taps; i ++)
+    {
+      filter->history[i] = in[0];
+    }
+    filter->sum = (long long)in[0] * taps;
+    filter->primed = true;
+  }
+  long long sum = filter->sum;
+  int next = filter->next;
+  for (int i = 0; i < n; i ++)
+  {
+    sum += in[i] - filter->history[next];
+    filter->history[next] = in[i];
+    next = (next + 1 == taps) ? 0 : next + 1;
+    out[i] = sum * scale;
+  }
+  filter->sum = sum;
+  filter->next = next;
+}
+
+
+void iir_init(IirFilter *filter, double cutoff, double sample_rate)
+{
+  filter->alpha = (float)(1 - exp(-2 * M_PI * cutoff / sample_rate));
+  filter->state = 0;
+  filter->primed = false;
+}
+
+
+// y[i] = y[i - 1] + alpha * (x[i] - y[i - 1]); the recurrence is serial,
+// so this one stays a scalar loop
+void iir_process(IirFilter *filter, const float *in, float *out, int n)
+{
+  if (n > 0 && !filter->primed)
+  {
+    filter->state = in[0];
+    filter->primed = true;
+  }
+  float y = filter->state;
+  float alpha = filter->alpha;
+  for (int i = 0; i < n; i ++)
+  {
+    y += alpha * (in[i] - y);
+    out[i] = y;
+  }
+  filter->state = y;
+}
+
+
+int cic_init(CicFilter *filter, int stages, int decimation)
+{
+  if (stages < 1 || stages > CIC_MAX_STAGES || decimation < 1 || pow(decimation, stages) > (1 << 20))
+  {
+    fprintf(stderr, "Unsupported CIC filter: %d stages, decimation %d\n", stages, decimation);
+    return -1;
   }
-  gpio_directions &= ~(0xFF << (group << 3));
-  gpio_directions |= (directions << (group << 3));
-  set_register(GPIO_BASE[ch] + GPIO_SWPORTA_DDR, gpio_directions);
+  memset(filter, 0, sizeof(CicFilter));
+  filter->stages = stages;
+  filter->decimation = decimation;
+  filter->gain = 1.0f / pow(decimation, stages);
   return 0;
 }
 
 
-int get_alt(int ch, int ln)
+// returns the number of outputs, one for every decimation inputs. The
+// integrators run in 32 bit modular arithmetic: the combs take the
+// differences back out exactly as long as the gain fits in the word.
+int cic_process(CicFilter *filter, const int *in, float *out, int n)
 {
-  int group = ln / 8;
-  int index = ln % 8;
-  int iomux = (GPIO_IOMUX[ch][group] == -1) ? -1 : get_register((ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group]);
-  if (iomux != -1)
+  int count = 0;
+  int stages = filter->stages;
+  for (int i = 0; i < n; i ++)
   {
-    return ((iomux >> (index << 1)) & 0x03);
+    unsigned int v = (unsigned int)in[i];
+    for (int s = 0; s < stages; s ++)
+    {
+      v = filter->integrators[s] += v;
+    }
+    if (++ filter->phase < filter->decimation)
+    {
+      continue;
+    }
+    filter->phase = 0;
+    for (int s = 0; s < stages; s ++)
+    {
+      unsigned int previous = filter->combs[s];
+      filter->combs[s] = v;
+      v -= previous;
+    }
+    out[count ++] = (int)v * filter->gain;
   }
-  return -1;
+  return count;
 }
 
 
-int set_alt(int ch, int ln, int alt)
+// spec: "boxcar:<length>", "iir:<cutoff Hz>" or "cic:<decimation>[:<stages>]"
+int adc_filter_init(AdcFilter *filter, const char *spec, double sample_rate)
 {
-  int group = ln / 8;
-  int index = ln % 8;
-  if (alt < 0 || alt > 3)
+  memset(filter, 0, sizeof(AdcFilter));
+  int a = 0, b = 3;
+  double hz;
+  if (spec == NULL || strcmp(spec, "none") == 0)
   {
-    fprintf(stderr, "Unsupported ALT value %d\n", alt);
-    return -2;
+    filter->type = ADC_FILTER_NONE;
+    return 0;
+  }
+  if (sscanf(spec, "boxcar:%d", &a) == 1)
+  {
+    filter->type = ADC_FILTER_BOXCAR;
+    return boxcar_init(&filter->boxcar, a);
   }
-  int iomux = (GPIO_IOMUX[ch][group] == -1) ? -1 : get_register((ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group]);
-  if (iomux != -1)
+  if (sscanf(spec, "iir:%lf", &hz) == 1)
   {
-    iomux &= ~(0x03 << (index << 1));
-    iomux |= (alt << (index << 1));
-    iomux |= (0x03 << ((index << 1) + 16));
-    set_register((ch < 2 ? PMUGRF : GRF) + GPIO_IOMUX[ch][group], iomux);
+    if (hz <= 0 || hz >= sample_rate / 2)
+    {
+      fprintf(stderr, "IIR cutoff %g Hz must be above 0 and below half the sample rate (%g Hz)\n", hz, sample_rate / 2);
+      return -1;
+    }
+    filter->type = ADC_FILTER_IIR;
+    iir_init(&filter->iir, hz, sample_rate);
     return 0;
   }
+  if (sscanf(spec, "cic:%d:%d", &a, &b) >= 1)
+  {
+    filter->type = ADC_FILTER_CIC;
+    return cic_init(&filter->cic, b, a);
+  }
+  fprintf(stderr, "Unknown filter: %s (should be boxcar:<length>, iir:<Hz> or cic:<decimation>[:<stages>])\n", spec);
   return -1;
 }
 
 
-int get(int ch, int ln)
+int adc_filter_decimation(const AdcFilter *filter)
 {
-  struct gpiod_chip *chip;
-	struct gpiod_line *line;
-	struct gpiod_line_request_config cfg;
-	int req, value, ret = 0;
-  chip_name[13] = ch + 0x30;
-	chip = gpiod_chip_open(chip_name);
-	if (chip)
-	{
-	  line = gpiod_chip_get_line(chip, ln);
-  	if (line)
-  	{
-  	  memset(&cfg, 0, sizeof(cfg));
-    	cfg.consumer = "vgp";
-    	cfg.request_type = GPIOD_LINE_REQUEST_DIRECTION_AS_IS;
-    	cfg.flags = 0;
-    	req = gpiod_line_request(line, &cfg, 0);
-    	if (req >= 0)
-    	{
-    	  value = gpiod_line_get_value(line);
-    	}
-    	else
-    	{
-    		ret = -3;
-    	}
-  	}
-  	else
-  	{
-  		ret = -2;
-  	}
-	}
-	else
-	{
-		ret = -1;
-  }
-  gpiod_line_release(line);
-  gpiod_chip_close(chip);
-  return ret == 0 ? value : ret;
+  return (filter->type == ADC_FILTER_CIC) ? filter->cic.decimation : 1;
 }
 
 
-int set(int ch, int ln, int val)
+// filters raw counts into out (counts as float), returns the number of outputs
+int adc_filter_process(AdcFilter *filter, const int *raw, float *out, int n)
 {
-  struct gpiod_chip *chip;
-	struct gpiod_line *line;
-	int req, ret = 0;
-  chip_name[13] = ch + 0x30;
-	chip = gpiod_chip_open(chip_name);
-	if (chip)
-	{
-	  line = gpiod_chip_get_line(chip, ln);
-  	if (line)
-  	{
-  	  req = gpiod_line_request_output(line, "vgp", 0);
-    	if (req >= 0)
-    	{
-        gpiod_line_set_value(line, val);
-    	}
-    	else
-    	{
-    		ret -3;
-    	}
-  	}
-  	else
-  	{
-  		ret -2;
-  	}
-	}
-	else
-	{
-		ret -1;
-  }
-  gpiod_line_release(line);
-  gpiod_chip_close(chip);
-  return ret;
+  if (filter->type == ADC_FILTER_CIC)
+  {
+    return cic_process(&filter->cic, raw, out, n);
+  }
+  if (filter->type == ADC_FILTER_BOXCAR)
+  {
+    boxcar_process(&filter->boxcar, raw, out, n);
+    return n;
+  }
+  float in[ADC_FILTER_BLOCK];
+  for (int done = 0; done < n; done += ADC_FILTER_BLOCK)
+  {
+    int count = (n - done < ADC_FILTER_BLOCK) ? n - done : ADC_FILTER_BLOCK;
+    adc_to_volts(raw + done, in, count, 1.0f);
+    if (filter->type == ADC_FILTER_IIR)
+    {
+      iir_process(&filter->iir, in, out + done, count);
+    }
+    else
+    {
+      memcpy(out + done, in, count * sizeof(float));
+    }
+  }
+  return n;
 }
 
 
-int get_adc(int a_pin)
+// ADC watcher. The thread wakes on absolute deadlines like the PWM thread,
+// reads every watched channel once per tick and updates the watches on it.
+
+AdcWatch adc_watches[ADC_WATCH_MAX];
+
+int adc_watch_next_id = 0;
+
+unsigned long long adc_watch_period_ns = 1000000000ULL / ADC_WATCH_RATE;
+
+unsigned long adc_watch_missed = 0;
+
+pthread_mutex_t adc_watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_cond_t adc_watch_cond;
+
+pthread_t adc_watch_thread;
+
+bool adc_watch_running = false;
+
+
+int adc_watch_zone(const AdcWatch *watch, int value)
 {
-  sprintf(command_buffer, "cat /sys/bus/iio/devices/iio:device0/in_voltage%d_raw", a_pin);
-  int length = run_command(command_buffer);
-  if (length < 0)
+  // the current outer zone extends hysteresis counts towards the inside
+  if (watch->high >= 0 && (value > watch->high || (watch->zone == ADC_ZONE_HIGH && value > watch->high - watch->hysteresis)))
   {
-    printf("get_adc returned an error\n");
+    return ADC_ZONE_HIGH;
+  }
+  if (watch->low >= 0 && (value < watch->low || (watch->zone == ADC_ZONE_LOW && value < watch->low + watch->hysteresis)))
+  {
+    return ADC_ZONE_LOW;
+  }
+  return ADC_ZONE_INSIDE;
+}
+
+
+// returns true when the watch has taken a new zone
+bool adc_watch_update(AdcWatch *watch, int value, unsigned long long now)
+{
+  watch->value = value;
+  int zone = adc_watch_zone(watch, value);
+  if (zone == watch->zone)
+  {
+    watch->candidate = zone;
+    return false;
+  }
+  if (zone != watch->candidate)
+  {
+    watch->candidate = zone;
+    watch->since = now;
+  }
+  if (now - watch->since < watch->dwell_ns)
+  {
+    return false;
+  }
+  watch->zone = zone;
+  watch->changed = watch->since;
+  watch->changes ++;
+  return true;
+}
+
+
+void * adc_watch_loop(void *arg)
+{
+  unsigned long long next = get_monotonic_ns();
+  pthread_mutex_lock(&adc_watch_mutex);
+  while (adc_watch_running)
+  {
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    if (pthread_cond_timedwait(&adc_watch_cond, &adc_watch_mutex, &ts) != ETIMEDOUT)
+    {
+      continue;   // stopped, or the rate has changed
+    }
+    unsigned long long now = get_monotonic_ns();
+    next += adc_watch_period_ns;
+    if (next <= now)
+    {
+      // keep the grid, but do not try to catch up
+      unsigned long long missed = (now - next) / adc_watch_period_ns + 1;
+      adc_watch_missed += missed;
+      next += missed * adc_watch_period_ns;
+    }
+
+    // the samples are read without holding the lock
+    bool watched[ADC_CHANNELS] = { false };
+    for (int i = 0; i < ADC_WATCH_MAX; i ++)
+    {
+      if (adc_watches[i].id >= 0)
+      {
+        watched[adc_watches[i].channel] = true;
+      }
+    }
+    pthread_mutex_unlock(&adc_watch_mutex);
+    int values[ADC_CHANNELS];
+    for (int c = 0; c < ADC_CHANNELS; c ++)
+    {
+      values[c] = watched[c] ? get_adc(c) : -1;
+    }
+    now = get_monotonic_ns();
+    pthread_mutex_lock(&adc_watch_mutex);
+
+    AdcWatch fired[ADC_WATCH_MAX];
+    int previous[ADC_WATCH_MAX];
+    int count = 0;
+    for (int i = 0; i < ADC_WATCH_MAX; i ++)
+    {
+      AdcWatch *watch = &adc_watches[i];
+      int prev = watch->zone;
+      if (watch->id >= 0 && values[watch->channel] >= 0 && adc_watch_update(watch, values[watch->channel], now)
+        && watch->callback != NULL)
+      {
+        fired[count] = *watch;
+        previous[count ++] = prev;
+      }
+    }
+    // callbacks may add or remove watches
+    pthread_mutex_unlock(&adc_watch_mutex);
+    for (int i = 0; i < count; i ++)
+    {
+      fired[i].callback(&fired[i], previous[i], fired[i].arg);
+    }
+    pthread_mutex_lock(&adc_watch_mutex);
+  }
+  pthread_mutex_unlock(&adc_watch_mutex);
+  return NULL;
+}
+
+
+// starts the watcher thread, or changes its rate if it is running
+int adc_watch_start(double rate)
+{
+  if (rate <= 0 || rate > 1e6)
+  {
+    fprintf(stderr, "Can not sample the ADC at %g Hz\n", rate);
     return -1;
   }
-  return atoi(output_buffer);
+  pthread_mutex_lock(&adc_watch_mutex);
+  adc_watch_period_ns = (unsigned long long)(1e9 / rate + 0.5);
+  if (adc_watch_running)
+  {
+    pthread_cond_signal(&adc_watch_cond);
+    pthread_mutex_unlock(&adc_watch_mutex);
+    return 0;
+  }
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&adc_watch_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  for (int i = 0; i < ADC_WATCH_MAX; i ++)
+  {
+    adc_watches[i].id = -1;
+  }
+  adc_watch_missed = 0;
+  adc_watch_running = true;
+  // signals are for the application's threads
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&adc_watch_thread, NULL, adc_watch_loop, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0)
+  {
+    printf("Can't create ADC watch thread :[%s]", strerror(err));
+    adc_watch_running = false;
+    pthread_cond_destroy(&adc_watch_cond);
+  }
+  pthread_mutex_unlock(&adc_watch_mutex);
+  return (err != 0) ? -1 : 0;
 }
 
 
-float get_voltage_by_adc(int adc)
+// thresholds are in counts, -1 disables one; returns the watch id
+int adc_watch_add(int channel, int low, int high, int hysteresis, unsigned long long dwell_ns, AdcWatchCallback callback, void *arg)
 {
-  return 5.0f * (float)adc / 1024;
+  if (low >= 0 && high >= 0 && low > high)
+  {
+    fprintf(stderr, "ADC watch low threshold %d is above the high one %d\n", low, high);
+    return -1;
+  }
+  // also opens the channel, the thread only reads it
+  if (get_adc(channel) < 0 || (!adc_watch_running && adc_watch_start(ADC_WATCH_RATE) < 0))
+  {
+    return -1;
+  }
+  pthread_mutex_lock(&adc_watch_mutex);
+  int id = -1;
+  for (int i = 0; i < ADC_WATCH_MAX; i ++)
+  {
+    AdcWatch *watch = &adc_watches[i];
+    if (watch->id < 0)
+    {
+      memset(watch, 0, sizeof(AdcWatch));
+      watch->id = id = adc_watch_next_id ++;
+      watch->channel = channel;
+      watch->low = low;
+      watch->high = high;
+      watch->hysteresis = (hysteresis > 0) ? hysteresis : 0;
+      watch->dwell_ns = dwell_ns;
+      watch->callback = callback;
+      watch->arg = arg;
+      watch->zone = watch->candidate = ADC_ZONE_UNKNOWN;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&adc_watch_mutex);
+  if (id < 0)
+  {
+    fprintf(stderr, "Too many ADC watches\n");
+  }
+  return id;
 }
 
 
-bool is_power_pin(int pin)
+int adc_watch_remove(int id)
 {
-  if (pin == 1 || pin == 2 || pin == 4 || pin == 6 || pin == 9 || pin == 14 
-    || pin == 17 || pin == 20 || pin == 25 || pin == 30 || pin == 34 || pin == 39) {
-    return true;
+  int ret = -1;
+  pthread_mutex_lock(&adc_watch_mutex);
+  for (int i = 0; i < ADC_WATCH_MAX && adc_watch_running; i ++)
+  {
+    if (adc_watches[i].id == id)
+    {
+      adc_watches[i].id = -1;
+      ret = 0;
+    }
   }
-  return false;  
+  pthread_mutex_unlock(&adc_watch_mutex);
+  return ret;
 }
 
 
-MonitorThread * monitor_threads[MONITOR_THREADS];
+int adc_watch_get(int id, AdcWatch *watch)
+{
+  int ret = -1;
+  pthread_mutex_lock(&adc_watch_mutex);
+  for (int i = 0; i < ADC_WATCH_MAX && adc_watch_running; i ++)
+  {
+    if (adc_watches[i].id == id)
+    {
+      *watch = adc_watches[i];
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&adc_watch_mutex);
+  return ret;
+}
 
 
-void thread_cleanup_handler(void *p)
+// sampling ticks missed because the thread was late
+unsigned long adc_watch_overruns()
 {
-  MonitorThread * params = (MonitorThread *)p;
-  gpiod_line_release(params->line);
-  gpiod_chip_close(params->chip);
+  pthread_mutex_lock(&adc_watch_mutex);
+  unsigned long missed = adc_watch_missed;
+  pthread_mutex_unlock(&adc_watch_mutex);
+  return missed;
 }
 
 
-void * monitor_pin(void *p)
+// must not be called from a watch callback
+void adc_watch_stop()
 {
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-  
-  MonitorThread * params = (MonitorThread *)p;
-  
-  sleep(params->delay);
-  
-  char * pin_name = (char *)NAMES[params->pin];
-  int ch = get_chip_number(pin_name);
-  int ln = get_line_number(pin_name);
-  
-  char chipname[15];
-  sprintf(chipname, "/dev/gpiochip%d", ch);
-  params->chip = gpiod_chip_open(chipname);
-  if (!params->chip)
+  pthread_mutex_lock(&adc_watch_mutex);
+  if (!adc_watch_running)
   {
-    perror("Error opening GPIO chip");
-    return NULL;
+    pthread_mutex_unlock(&adc_watch_mutex);
+    return;
   }
-  
-  params->line = gpiod_chip_get_line(params->chip, ln);
-  if (!params->line)
+  adc_watch_running = false;
+  pthread_cond_signal(&adc_watch_cond);
+  pthread_mutex_unlock(&adc_watch_mutex);
+  pthread_join(adc_watch_thread, NULL);
+  pthread_cond_destroy(&adc_watch_cond);
+}
+
+
+// Reflex rules. The targets of all rules on a pin and edge are merged into
+// one BankWrite, which the monitor thread stores without leaving the event
+// dispatch.
+
+bool reflex_monitored[MONITOR_PINS];   // pins monitor_add_pin() was called for
+
+
+// checks the rules and merges them into one action per trigger pin and
+// edge; the target pins must already be outputs
+int reflex_merge(const ReflexRule *rules, int count, ReflexAction actions[MONITOR_PINS][2])
+{
+  memset(actions, 0, sizeof(ReflexAction) * MONITOR_PINS * 2);
+  for (int i = 0; i < count; i ++)
   {
-    perror("Error getting GPIO line");
-    gpiod_chip_close(params->chip);
-    return NULL;
+    const ReflexRule *rule = &rules[i];
+    if (rule->pin <= 0 || rule->pin >= MONITOR_PINS || is_power_pin(rule->pin)
+      || rule->edge < GPIO_RISING_EDGE || rule->edge > GPIO_BOTH_EDGES)
+    {
+      fprintf(stderr, "Reflex rule %d: can not trigger on pin %d\n", i + 1, rule->pin);
+      return -1;
+    }
+    char * pin_name = (char *)NAMES[rule->pin];
+    int ch = get_chip_number(pin_name);
+    int ln = get_line_number(pin_name);
+    if (rule->write.mask[ch] & (1u << ln))
+    {
+      fprintf(stderr, "Reflex rule %d: pin %d (%s) can not drive itself\n", i + 1, rule->pin, pin_name);
+      return -1;
+    }
+    for (int c = 0; c < 5; c ++)
+    {
+      for (int l = 0; l < 32; l ++)
+      {
+        if ((rule->write.mask[c] & (1u << l)) && get_dir(c, l) != GPIO_OUTPUT)
+        {
+          fprintf(stderr, "Reflex rule %d: GPIO%d_%c%d is not an output\n", i + 1, c, 'A' + l / 8, l % 8);
+          return -1;
+        }
+      }
+    }
+    for (int e = 0; e < 2; e ++)
+    {
+      if (rule->edge & (e == 0 ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE))
+      {
+        // a later rule wins where two rules drive the same pin
+        ReflexAction *action = &actions[rule->pin][e];
+        for (int c = 0; c < 5; c ++)
+        {
+          action->write.mask[c] |= rule->write.mask[c];
+          action->write.value[c] = (action->write.value[c] & ~rule->write.mask[c]) | (rule->write.value[c] & rule->write.mask[c]);
+        }
+        action->rules ++;
+      }
+    }
   }
+  return 0;
+}
 
-  pthread_cleanup_push(thread_cleanup_handler, p);
 
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  
-  // request event
-  int ret;
-  switch (params->wait_for)
+// replaces the loaded rules
+int reflex_load(const ReflexRule *rules, int count)
+{
+  static ReflexAction actions[MONITOR_PINS][2];
+  if (reflex_merge(rules, count, actions) < 0 || start_monitor() < 0)
   {
-    case GPIO_RISING_EDGE: 
-      ret = gpiod_line_request_rising_edge_events(params->line, "vgplib");
-      break;
-    case GPIO_FALLING_EDGE:
-      ret = gpiod_line_request_falling_edge_events(params->line, "vgplib");
-      break;
-    case GPIO_BOTH_EDGES:
-      ret = gpiod_line_request_both_edges_events(params->line, "vgplib");
-      break;
-    default:
-      ret = -1;
+    return -1;
+  }
+  pthread_mutex_lock(&monitor_mutex);
+  memcpy(reflex_actions, actions, sizeof(actions));
+  pthread_mutex_unlock(&monitor_mutex);
+
+  int ret = 0;
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    bool used = actions[pin][0].rules > 0 || actions[pin][1].rules > 0;
+    if (used && !is_pin_monitored(pin))
+    {
+      // the rules run from the dispatch, the pin needs no callback
+      if (monitor_add_pin(pin, GPIO_BOTH_EDGES, NULL) < 0)
+      {
+        ret = -1;
+        break;
+      }
+      reflex_monitored[pin] = true;
+    }
+    else if (!used && reflex_monitored[pin])
+    {
+      monitor_remove_pin(pin);
+      reflex_monitored[pin] = false;
+    }
   }
   if (ret < 0)
   {
-    perror("Error requesting GPIO line events");
-    gpiod_line_release(params->line);
-    gpiod_chip_close(params->chip);
-    return NULL;
+    reflex_unload();
   }
-  
-  // wait for event
-  while (1)
+  return ret;
+}
+
+
+void reflex_unload()
+{
+  if (monitor_epoll_fd == -1)
   {
-    pthread_testcancel();
-    
-    struct gpiod_line_event event;
-    ret = gpiod_line_event_wait(params->line, NULL);
-    if (ret < 0) {
-        perror("Error waiting for GPIO event");
-        gpiod_line_release(params->line);
-        gpiod_chip_close(params->chip);
-        return NULL;
-    }
-    ret = gpiod_line_event_read(params->line, &event);
-    if (ret < 0) {
-        perror("Error reading GPIO event");
-        gpiod_line_release(params->line);
-        gpiod_chip_close(params->chip);
-        return NULL;
-    }
-    params->latest_event = (event.event_type == GPIOD_LINE_EVENT_RISING_EDGE ? GPIO_RISING_EDGE : GPIO_FALLING_EDGE);
-    params->callback(p);
-  }
-    
-  // release GPIO resources
-  gpiod_line_release(params->line);
-  gpiod_chip_close(params->chip);
-  
-  pthread_cleanup_pop(0);
-  
-  return NULL;
+    return;
+  }
+  pthread_mutex_lock(&monitor_mutex);
+  memset(reflex_actions, 0, sizeof(reflex_actions));
+  pthread_mutex_unlock(&monitor_mutex);
+  for (int pin = 1; pin < MONITOR_PINS; pin ++)
+  {
+    if (reflex_monitored[pin])
+    {
+      monitor_remove_pin(pin);
+      reflex_monitored[pin] = false;
+    }
+  }
 }
 
 
-void create_monitor_thread(int pin, int delay, int wait_for, void (*callback)(void*))
+// edge is GPIO_RISING_EDGE or GPIO_FALLING_EDGE, returns -1 without rules
+int reflex_get_action(int pin, int edge, ReflexAction *action)
 {
-  monitor_threads[pin] = (MonitorThread *)malloc(sizeof(MonitorThread));
-  monitor_threads[pin]->pin = pin;
-  monitor_threads[pin]->delay = delay;
-  monitor_threads[pin]->wait_for = wait_for;
-  monitor_threads[pin]->callback = callback;
-  int err = pthread_create(&(monitor_threads[pin]->thread), NULL, monitor_pin, (void*)monitor_threads[pin]);
-  if (err != 0)
+  if (monitor_epoll_fd == -1 || pin <= 0 || pin >= MONITOR_PINS || (edge != GPIO_RISING_EDGE && edge != GPIO_FALLING_EDGE))
   {
-    printf("Can't create monitor thread :[%s]", strerror(err));
+    return -1;
   }
+  pthread_mutex_lock(&monitor_mutex);
+  *action = reflex_actions[pin][edge == GPIO_RISING_EDGE ? 0 : 1];
+  pthread_mutex_unlock(&monitor_mutex);
+  return (action->rules > 0) ? 0 : -1;
 }
@@ -26,10 +26,195 @@ static const char GPIO_GROUP[] = { 'A', 'B', 'C', 'D' };
 static const char * GPIO_DIRECTION[] = { "IN", "OUT" };
 
 
+// Register access backends
+#define REGISTER_BACKEND_AUTO  0  // map /dev/mem when possible, otherwise use io
+#define REGISTER_BACKEND_IO    1  // run "sudo io" for every access
+#define REGISTER_BACKEND_MEM   2  // volatile loads/stores on mapped registers
+#define REGISTER_BACKEND_SIM   3  // in-memory simulation of GPIO banks and IOMUX
+
+typedef struct {
+  unsigned int base;
+  unsigned int size;
+  unsigned int file_offset;
+  volatile unsigned int * ptr;
+} RegisterWindow;
+
+typedef struct {
+  const char * name;
+  int (*open)();
+  void (*close)();
+  int (*read32)(unsigned int address, unsigned int *value);
+  int (*write32)(unsigned int address, unsigned int value);
+  int (*read_many)(const unsigned int *addresses, unsigned int *values, int count);
+  int (*write_masked)(unsigned int address, unsigned int mask, unsigned int value);
+} RegisterBackend;
+
+typedef struct {
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long bytes_read;
+  unsigned long bytes_written;
+} RegisterStats;
+
+int set_register_backend(int backend);
+
+int get_register_backend();
+
+const RegisterBackend * get_register_ops();
+
+void close_register_backend();
+
+void get_register_stats(RegisterStats *stats);
+
+void reset_register_stats();
+
+void set_simulated_inputs(int ch, unsigned int value);
+
+// Per-operation latency statistics, only compiled in with -DVGP_STATS
+// (make VGP_STATS=1). Every thread counts into its own block, the blocks
+// are summed when the statistics are read.
+
+#define STAT_REGISTER_READ   0
+#define STAT_REGISTER_WRITE  1
+#define STAT_GET             2
+#define STAT_SET             3
+#define STAT_MODE            4
+#define STAT_ALT             5
+#define STAT_SNAPSHOT        6
+#define STAT_ADC             7
+#define STAT_EDGE_DISPATCH   8
+#define STAT_OPS             9
+
+#define STAT_BUCKETS  128   // 4 per power of two of ns, the last one collects everything above 2^31 ns
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long total_ns;
+  unsigned long long min_ns;
+  unsigned long long max_ns;
+  unsigned long long buckets[STAT_BUCKETS];
+} OpStats;
+
+#ifdef VGP_STATS
+#define STATS_BEGIN()             unsigned long long stats_start = stats_clock_ns()
+#define STATS_RETURN(op, value)   do { int stats_ret = (value); stats_record(op, stats_start); return stats_ret; } while (0)
+#else
+#define STATS_BEGIN()
+#define STATS_RETURN(op, value)   return (value)
+#endif
+
+unsigned long long stats_clock_ns();
+
+void stats_record(int op, unsigned long long start);
+
+bool op_stats_enabled();
+
+void get_op_stats(OpStats *stats);
+
+void reset_op_stats();
+
+unsigned long long op_stats_bucket_limit(int bucket);
+
+unsigned long long op_stats_percentile(const OpStats *stats, double fraction);
+
+void write_op_stats(FILE *f, bool json);
+
+bool is_hiword_mask_register(unsigned int address);
+
+int read_register(unsigned int address, unsigned int *value);
+
+int write_register(unsigned int address, unsigned int value);
+
+int read_registers(const unsigned int *addresses, unsigned int *values, int count);
+
+int write_register_masked(unsigned int address, unsigned int mask, unsigned int value);
+
+void begin_register_batch();
+
+int flush_register_batch();
+
+int end_register_batch();
+
+// end an open batch for writes that must happen at once, and reopen it
+bool suspend_register_batch();
+
+void resume_register_batch(bool suspended);
+
+// cross-process lock around register read-modify-write sequences
+#define REGISTER_LOCK_FILE  "/var/lock/vgp-registers.lock"
+
+int lock_registers();
+
+void unlock_registers();
+
 int get_register(unsigned int address);
 
 int set_register(unsigned int address, unsigned int value);
 
+struct gpiod_chip * open_chip(int ch);
+
+// vgpd daemon protocol: SOCK_SEQPACKET frames of a header followed by
+// fixed size records. A request is answered by a response frame holding the
+// same records with their results filled in. Subscribed connections also
+// receive event frames.
+
+#define VGPD_SOCKET_PATH     "/run/vgpd.sock"
+#define VGPD_MAGIC           0x56
+#define VGPD_MAX_RECORDS     64
+
+#define VGPD_FRAME_REQUEST   1
+#define VGPD_FRAME_RESPONSE  2
+#define VGPD_FRAME_EVENT     3
+
+#define VGPD_OP_GET          1   // target: line, result: value
+#define VGPD_OP_SET          2   // target: line, arg: value
+#define VGPD_OP_MODE         3   // target: line, arg: direction or -1 to query
+#define VGPD_OP_ALT          4   // target: line, arg: alt or -1 to query
+#define VGPD_OP_ADC          5   // target: ADC channel, result: raw value
+#define VGPD_OP_SUBSCRIBE    6   // target: physical pin, arg: edges (0 unsubscribes)
+
+#define VGPD_LINE(ch, ln)    (((ch) << 5) | (ln))
+
+typedef struct {
+  unsigned char magic;
+  unsigned char type;
+  unsigned short count;
+  unsigned int reserved;  // keeps the records 8 byte aligned
+} VgpdHeader;
+
+typedef struct {
+  unsigned char op;
+  unsigned char target;
+  short arg;
+  int result;
+} VgpdRecord;
+
+typedef struct {
+  unsigned char pin;
+  unsigned char edge;
+  unsigned short reserved;
+  unsigned int sequence;
+  unsigned long long timestamp;
+} VgpdEvent;
+
+typedef struct {
+  VgpdHeader header;
+  union {
+    VgpdRecord records[VGPD_MAX_RECORDS];
+    VgpdEvent events[VGPD_MAX_RECORDS];
+  };
+} VgpdFrame;
+
+int vgpd_connect();
+
+int vgpd_attach();
+
+void vgpd_detach();
+
+int vgpd_call(int fd, VgpdRecord *records, int count);
+
+int vgpd_single(int op, int target, int arg);
+
 int get_chip_number(char *pin_name);
 
 int get_line_number(char *pin_name);
@@ -38,18 +223,170 @@ int get_dir(int ch, int ln);
 
 int set_dir(int ch, int ln, int dir);
 
+int get_iomux_address(int ch, int ln);
+
 int get_alt(int ch, int ln);
 
 int set_alt(int ch, int ln, int alt);
 
+// all GPIO bank and IOMUX registers, read in one pass
+typedef struct {
+  unsigned int dr[5];
+  unsigned int ext[5];
+  unsigned int ddr[5];
+  unsigned int iomux[5][4];
+} BoardSnapshot;
+
+int read_board_snapshot(BoardSnapshot *snapshot);
+
+int snapshot_get_alt(const BoardSnapshot *snapshot, int ch, int ln);
+
+int snapshot_get_dir(const BoardSnapshot *snapshot, int ch, int ln);
+
+int snapshot_get_value(const BoardSnapshot *snapshot, int ch, int ln);
+
+// alt, direction and output level of a set of lines, laid out like the
+// registers so that applying it is a compare and one masked store per
+// register that differs
+typedef struct {
+  unsigned int mask[5];         // lines the profile sets
+  unsigned int iomux[5][4];     // 2 bits per line
+  unsigned int ddr[5];
+  unsigned int dr[5];           // levels of the outputs
+} PinProfile;
+
+void profile_init(PinProfile *profile);
+
+int profile_set(PinProfile *profile, int ch, int ln, int alt, int dir, int value);
+
+int profile_apply(const PinProfile *profile);
+
+// output values for several pins, applied as one masked store per bank
+typedef struct {
+  unsigned int mask[5];
+  unsigned int value[5];
+} BankWrite;
+
+void bank_write_init(BankWrite *bw);
+
+void bank_write_add(BankWrite *bw, int ch, int ln, int val);
+
+int bank_write_apply(const BankWrite *bw);
+
+int bank_write_outputs(const BankWrite *bw);
+
+// parallel bus: header pins read/written as one integer word, bit 0 first.
+// Runs of word bits that land on consecutive lines of a bank form a
+// segment, moved into place with a single mask and shift.
+#define BUS_MAX_PINS  32
+
+typedef struct {
+  int ch;
+  unsigned int word_mask;
+  int shift;              // line = bit + shift
+} BusSegment;
+
+typedef struct {
+  const char * name;
+  int width;
+  int pins[BUS_MAX_PINS];
+  int segment_count;
+  BusSegment segments[BUS_MAX_PINS];
+  unsigned int bank_mask[5];
+} Bus;
+
+int bus_init(Bus *bus, const char *name, const int *pins, int width);
+
+int bus_set_dir(const Bus *bus, int dir);
+
+int bus_write(const Bus *bus, unsigned int word);
+
+int bus_read(const Bus *bus, unsigned int *word);
+
+// cached gpiod line request
+typedef struct {
+  struct gpiod_line * line;
+  int request_type;   // 0 when the line is not requested
+} CachedLine;
+
+void set_line_cache_enabled(bool enabled);
+
+void release_cached_line(int ch, int ln);
+
+void close_line_cache();
+
 int get(int ch, int ln);
 
 int set(int ch, int ln, int val);
 
+#define IIO_DEVICES_PATH  "/sys/bus/iio/devices"
+#define ADC_DEVICE_NAME   "saradc"   // e.g. ff100000.saradc
+#define ADC_CHANNELS      6
+
+const char * get_adc_device_path();
+
+void close_adc();
+
 int get_adc(int a_pin);
 
+// the header's 0-5V range is divided down to the SARADC's 1.8V reference
+#define ADC_INPUT_DIVIDER  (5.0f / 1.8f)
+#define ADC_DEFAULT_SCALE  (5.0f / 1024)   // without in_voltage_scale
+
+float get_adc_scale();
+
 float get_voltage_by_adc(int adc);
 
+// IIO triggered buffer streaming of ADC channels: the enabled scan elements
+// of every trigger are packed into one frame read from /dev/iio:deviceN
+
+#define ADC_STREAM_TRIGGER      "vgp-adc"   // hrtimer trigger created in configfs
+#define IIO_HRTIMER_CONFIGFS    "/sys/kernel/config/iio/triggers/hrtimer"
+#define ADC_STREAM_BLOCK_FRAMES 256         // frames per read()
+
+typedef struct {
+  int channel;          // index in the requested channels, -1 for the timestamp, -2 if not requested
+  int index;            // position in the scan
+  bool is_signed;
+  bool big_endian;
+  int bits;
+  int storage_bits;
+  int shift;
+  int offset;           // byte offset in the frame
+} IioScanElement;
+
+typedef struct {
+  long long timestamp;            // ns, 0 without a timestamp element
+  int values[ADC_CHANNELS];       // in the order the channels were requested
+} AdcFrame;
+
+typedef struct {
+  int fd;
+  int record_fd;                  // if not -1, everything read is copied to it
+  bool from_file;
+  bool enabled;
+  bool created_trigger;
+  int count;
+  int channels[ADC_CHANNELS];
+  IioScanElement elements[ADC_CHANNELS + 1];   // enabled elements in scan order
+  int element_count;
+  int timestamp_element;          // -1 if the scan has no timestamp
+  int frame_size;
+  unsigned char * buffer;
+  int buffer_size;
+  int buffered;                   // bytes in buffer, a partial frame stays at the front
+} AdcStream;
+
+int iio_parse_scan_type(const char *text, IioScanElement *element);
+
+int adc_stream_open(AdcStream *stream, const int *channels, int count, double rate, const char *trigger);
+
+int adc_stream_open_file(AdcStream *stream, const int *channels, int count, const char *path);
+
+int adc_stream_read(AdcStream *stream, AdcFrame *frames, int max);
+
+void adc_stream_close(AdcStream *stream);
+
 
 // 40-pin GPIO header
 static const char *NAMES[] = { NULL,
@@ -103,31 +440,409 @@ static const char * FUNCTIONS[][4] = { {NULL, NULL, NULL, NULL},
 bool is_power_pin(int pin);
 
 
-// GPIO pin state monitor thread
+// GPIO pin state monitor
 
 #define GPIO_RISING_EDGE   1
 #define GPIO_FALLING_EDGE  2
 #define GPIO_BOTH_EDGES    3
 
-#define MONITOR_THREADS    41
+#define MONITOR_PINS         41
+#define MONITOR_EVENT_BATCH  16
+#define MONITOR_WAKEUP       0xffffffff
+#define MONITOR_TIMER        0xfffffffe
+
+// software debounce state of one line
+typedef struct {
+  unsigned long long settle_ns;       // 0 disables the filter
+  int stable_level;                   // -1 while unknown
+  int pending_level;
+  bool pending;
+  unsigned long long deadline;        // when the pending level has settled
+  unsigned long long level_since[2];  // first edge to each level in the burst
+  unsigned long burst_edges;
+  unsigned long suppressed;           // edges filtered out
+  unsigned long passed;               // edges passed on
+} Debouncer;
+
+void debounce_init(Debouncer *d, unsigned long long settle_ns);
+
+// starts the filter from the current level of a requested line
+void debounce_seed(Debouncer *d, struct gpiod_line *line);
+
+int debounce_feed(Debouncer *d, int edge, unsigned long long timestamp, unsigned long long *settled);
+
+int debounce_poll(Debouncer *d, unsigned long long now, unsigned long long *timestamp);
 
 typedef struct {
   int pin;
-  pthread_t thread;
-  int delay;
   int wait_for;
   int latest_event;
+  unsigned long long latest_timestamp;  // kernel timestamp of latest_event in ns
   void (*callback)(void*);
+  struct gpiod_line * line;
+  Debouncer debounce;
+} MonitorPin;
+
+// monitored lines of one gpiochip, each with its own edge event request
+typedef struct {
+  struct gpiod_chip * chip;
+  int pins[32];   // header pin by line offset, 0 if not monitored
+} MonitorChip;
+
+extern MonitorPin monitor_pins[MONITOR_PINS];
+
+// every edge seen by the monitor, kept in a ring buffer
+
+#define EVENT_RING_SIZE  4096   // must be a power of two
+
+typedef struct {
+  int pin;
+  int edge;
+  unsigned long long timestamp;   // kernel timestamp in ns
+  unsigned long long sequence;
+} EdgeEvent;
+
+typedef struct {
+  unsigned long long seq;
+  EdgeEvent event;
+} EventSlot;
+
+typedef struct {
+  unsigned long long cursor;    // sequence of the next event to read
+  unsigned long long dropped;   // events overwritten before they were read
+} EventReader;
+
+void event_reader_init(EventReader *reader);
+
+int event_reader_read(EventReader *reader, EdgeEvent *events, int max);
+
+int vgpd_read_events(int fd, EdgeEvent *events, int max);
+
+// waits for edges on one line without the monitor thread
+
+typedef struct {
+  int pin;
+  int wait_for;
   struct gpiod_chip * chip;
   struct gpiod_line * line;
-} MonitorThread;
+  Debouncer debounce;
+} EdgeWaiter;
+
+int edge_waiter_open(EdgeWaiter *waiter, int pin, int wait_for);
+
+int edge_waiter_set_debounce(EdgeWaiter *waiter, unsigned int settle_us);
+
+int edge_waiter_wait(EdgeWaiter *waiter, int timeout_ms, EdgeEvent *event);
+
+void edge_waiter_close(EdgeWaiter *waiter);
+
+unsigned long long get_monotonic_ns();
+
+unsigned long long get_event_clock_ns(unsigned long long reference);
+
+long long get_edge_latency_ns(unsigned long long timestamp);
+
+int start_monitor();
+
+void stop_monitor();
+
+int monitor_add_pin(int pin, int wait_for, void (*callback)(void*));
+
+int monitor_remove_pin(int pin);
+
+bool is_pin_monitored(int pin);
+
+int monitor_set_debounce(int pin, unsigned int settle_us);
+
+
+// logic analyzer capture of a bus: only changes of the bus word are stored,
+// in a ring allocated up front
+
+#define CAPTURE_SAMPLED   0   // read EXT_PORTA of the bus banks in a tight loop
+#define CAPTURE_EDGES     1   // merge the monitor's edge events of the bus pins
+
+#define CAPTURE_MAGIC     "VGPCAP1"
+
+typedef struct {
+  unsigned long long timestamp;   // CLOCK_MONOTONIC ns
+  unsigned int word;              // bus word from this time on
+} CaptureSample;
+
+typedef struct {
+  const Bus * bus;
+  int mode;
+  int trigger_bit;                // bus bit to trigger on, -1 triggers at once
+  int trigger_edge;               // GPIO_RISING_EDGE, GPIO_FALLING_EDGE or GPIO_BOTH_EDGES
+  unsigned long long pre_ns;      // kept before the trigger
+  unsigned long long post_ns;     // captured after the trigger
+  CaptureSample * ring;
+  int capacity;
+  // results of capture_run()
+  int head;                       // oldest sample in the ring
+  int count;
+  unsigned long long start;       // start of the pre trigger window
+  unsigned long long trigger;     // 0 if the trigger was not seen
+  unsigned long polls;            // bus reads, or edge events processed
+  unsigned long long lost;        // edge events dropped by the event ring
+  bool truncated;                 // the ring filled up before the window ended
+} Capture;
+
+int capture_init(Capture *cap, const Bus *bus, int capacity);
+
+void capture_free(Capture *cap);
+
+int capture_run(Capture *cap, int timeout_ms);
+
+void capture_get(const Capture *cap, int i, CaptureSample *sample);
+
+int capture_write_vcd(const Capture *cap, FILE *f);
+
+int capture_write_binary(const Capture *cap, FILE *f);
+
+
+// running min/max/mean/standard deviation of a series of values
+typedef struct {
+  unsigned long count;
+  double min;
+  double max;
+  double mean;
+  double m2;      // sum of squared differences from the mean
+} RunningStats;
+
+void running_stats_reset(RunningStats *stats);
+
+void running_stats_add(RunningStats *stats, double value);
+
+void running_stats_merge(RunningStats *stats, const RunningStats *other);
+
+double running_stats_stddev(const RunningStats *stats);
+
+
+// sequence player: steps are bank writes at offsets from the start,
+// played against absolute CLOCK_MONOTONIC deadlines
+
+#define SEQUENCE_START_DELAY_NS  1000000   // first deadline after sequence_play() is called
+
+typedef struct {
+  unsigned long long offset_ns;
+  BankWrite write;
+  RunningStats lateness;    // ns from the deadline to the completed store
+} SequenceStep;
+
+typedef struct {
+  SequenceStep * steps;
+  int count;
+  int capacity;
+  unsigned long long period_ns;   // loop length, 0 for the last offset plus the gap before it
+} Sequence;
+
+void sequence_init(Sequence *seq);
+
+void sequence_free(Sequence *seq);
+
+int sequence_add_step(Sequence *seq, unsigned long long offset_ns, const BankWrite *write);
+
+int sequence_play(Sequence *seq, int loops, RunningStats *lateness);
+
+void sequence_stop();
 
-extern MonitorThread * monitor_threads[MONITOR_THREADS];
 
-void thread_cleanup_handler(void *p);
+// software PWM: one scheduler thread keeps the next edge of every channel
+// in a min-heap, and writes the edges due within one tick with one store
+// per bank
+
+#define PWM_TICK_NS        20000     // edges this close together are written at once
+#define PWM_START_GRID_NS  1000000   // first edges are aligned to this
+
+typedef struct {
+  int pin;
+  int ch;
+  int ln;
+  unsigned long long period_ns;
+  unsigned long long high_ns;
+  unsigned long long next_ns;     // scheduled time of the next edge
+  int level;                      // level until the next edge
+  int heap_index;                 // -1 when not scheduled
+  unsigned long periods;          // rising edges written
+  unsigned long skipped;          // periods dropped because the thread was too late
+  unsigned long long first_rise;  // when the first and latest rising edges were written
+  unsigned long long last_rise;
+  RunningStats lateness;          // ns from the scheduled edge to the completed store, may be negative
+} PwmChannel;
+
+int pwm_start(int pin, double frequency, double duty);
+
+int pwm_stop(int pin);
+
+void pwm_shutdown();
+
+int pwm_get_stats(int pin, PwmChannel *stats);
+
+double pwm_achieved_frequency(const PwmChannel *stats);
+
+
+// frequency and pulse width of a signal, from edge timestamps
+typedef struct {
+  int last_edge;                  // 0 until the first edge
+  unsigned long long last_rise;
+  unsigned long long last_fall;
+  bool fall_after_rise;           // no edge was lost between last_rise and last_fall
+  RunningStats period;            // ns between rising edges
+  RunningStats high;              // ns from rising to falling edge
+  RunningStats low;               // ns from falling to rising edge
+  unsigned long edges;
+} PulseMeter;
+
+void pulse_meter_init(PulseMeter *meter);
+
+void pulse_meter_feed(PulseMeter *meter, int edge, unsigned long long timestamp);
+
+void pulse_meter_next_window(PulseMeter *meter);
+
+double pulse_meter_frequency(const PulseMeter *meter);
+
+double pulse_meter_duty(const PulseMeter *meter);
+
+
+// ADC sample filters. They work on blocks of samples; the count to volts
+// conversion has no dependency between samples, so that the compiler can
+// vectorize it (NEON on arm64, see the makefile flags). The filters
+// themselves are running sums and recurrences.
+
+#define ADC_FILTER_BLOCK     256
+#define BOXCAR_MAX_LENGTH    256
+#define CIC_MAX_STAGES       5
+
+#define ADC_FILTER_NONE      0
+#define ADC_FILTER_BOXCAR    1   // moving average of the last length samples
+#define ADC_FILTER_IIR       2   // single pole low-pass
+#define ADC_FILTER_CIC       3   // cascaded integrator-comb decimator
+
+typedef struct {
+  int length;
+  bool primed;
+  long long sum;                     // of the last length inputs
+  int next;                          // oldest input in history
+  int history[BOXCAR_MAX_LENGTH];    // the last length inputs, a ring
+} BoxcarFilter;
+
+typedef struct {
+  float alpha;
+  float state;
+  bool primed;
+} IirFilter;
+
+typedef struct {
+  int stages;
+  int decimation;
+  int phase;
+  unsigned int integrators[CIC_MAX_STAGES];   // wrap around on purpose
+  unsigned int combs[CIC_MAX_STAGES];
+  float gain;
+} CicFilter;
+
+typedef struct {
+  int type;
+  union {
+    BoxcarFilter boxcar;
+    IirFilter iir;
+    CicFilter cic;
+  };
+} AdcFilter;
+
+void adc_to_volts(const int *raw, float *volts, int n, float scale);
+
+int boxcar_init(BoxcarFilter *filter, int length);
+
+void boxcar_process(BoxcarFilter *filter, const int *in, float *out, int n);
+
+void iir_init(IirFilter *filter, double cutoff, double sample_rate);
+
+void iir_process(IirFilter *filter, const float *in, float *out, int n);
+
+int cic_init(CicFilter *filter, int stages, int decimation);
+
+int cic_process(CicFilter *filter, const int *in, float *out, int n);
+
+int adc_filter_init(AdcFilter *filter, const char *spec, double sample_rate);
+
+int adc_filter_decimation(const AdcFilter *filter);
+
+int adc_filter_process(AdcFilter *filter, const int *raw, float *out, int n);
+
+
+// ADC watcher: one thread samples the watched channels at a fixed rate and
+// calls back when a channel moves between the zones below low, between low
+// and high, and above high. An outer zone is only left hysteresis counts
+// past its threshold, and a new zone is only taken after the samples stayed
+// in it for the dwell time.
+
+#define ADC_WATCH_MAX        16
+#define ADC_WATCH_RATE       1000    // samples per second per channel
+
+#define ADC_ZONE_UNKNOWN     0       // until the first zone has been taken
+#define ADC_ZONE_LOW         1
+#define ADC_ZONE_INSIDE      2
+#define ADC_ZONE_HIGH        3
+
+typedef struct AdcWatch AdcWatch;
+
+// runs on the watcher thread with a copy of the watch
+typedef void (*AdcWatchCallback)(const AdcWatch *watch, int previous, void *arg);
+
+struct AdcWatch {
+  int id;                         // -1 when the slot is free
+  int channel;
+  int low;                        // counts, -1 without a low threshold
+  int high;                       // counts, -1 without a high threshold
+  int hysteresis;                 // counts
+  unsigned long long dwell_ns;
+  AdcWatchCallback callback;
+  void * arg;
+  int zone;
+  int value;                      // latest sample
+  int candidate;                  // zone of the latest samples
+  unsigned long long since;       // first sample in the candidate zone
+  unsigned long long changed;     // first sample in the current zone
+  unsigned long changes;
+};
+
+int adc_watch_start(double rate);
+
+int adc_watch_add(int channel, int low, int high, int hysteresis, unsigned long long dwell_ns, AdcWatchCallback callback, void *arg);
+
+int adc_watch_remove(int id);
+
+int adc_watch_get(int id, AdcWatch *watch);
+
+unsigned long adc_watch_overruns();
+
+void adc_watch_stop();
+
+
+// reflex rules: outputs written by the monitor thread right after an edge,
+// as one masked store per bank, without a round trip through the application
+
+#define REFLEX_MAX_RULES  64
+
+typedef struct {
+  int pin;                  // trigger pin
+  int edge;                 // GPIO_RISING_EDGE, GPIO_FALLING_EDGE or GPIO_BOTH_EDGES
+  BankWrite write;          // levels of the output pins
+} ReflexRule;
+
+typedef struct {
+  BankWrite write;          // merged from every rule on the pin and edge
+  int rules;
+  unsigned long fired;
+  unsigned long failed;
+  RunningStats latency;     // ns from the kernel timestamp of the edge to the completed store
+} ReflexAction;
+
+int reflex_merge(const ReflexRule *rules, int count, ReflexAction actions[MONITOR_PINS][2]);
 
-void * monitor_pin(void *p);
+int reflex_load(const ReflexRule *rules, int count);
 
-void create_monitor_thread(int pin, int delay, int wait_for, void (*callback)(void*));
+void reflex_unload();
 
-void init_monitor_threads(void (*callback)(void*));
+int reflex_get_action(int pin, int edge, ReflexAction *action);
@@ -0,0 +1,187 @@
+#include <gpiod.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "vgplib.h"
+
+
+// Tests that need no hardware, run with "make test": synthetic edge streams
+// replayed through the software debouncer, register batches against a fake
+// register file, and reflex rules merged on the simulated banks.
+
+#define REPLAY_STEPS  16
+#define REPLAY_EDGES  8
+
+#define POLL  0       // a replay step that only polls, like the settle timer firing
+
+typedef struct {
+  int edge;                  // GPIO_RISING_EDGE, GPIO_FALLING_EDGE or POLL
+  unsigned long long us;
+} ReplayStep;
+
+typedef struct {
+  const char *name;
+  unsigned long long settle_us;
+  int level;                 // level the line was at when it was requested
+  ReplayStep steps[REPLAY_STEPS];
+  int edges[REPLAY_EDGES];   // expected edges, up to the first 0
+  unsigned long long edge_us[REPLAY_EDGES];
+  unsigned long suppressed;
+} ReplayCase;
+
+
+ReplayCase replay_cases[] = {
+  { "clean rising edge", 50, 0,
+    { { GPIO_RISING_EDGE, 100 }, { POLL, 150 } },
+    { GPIO_RISING_EDGE }, { 100 }, 0 },
+  { "glitch on a low line", 50, 0,
+    { { GPIO_RISING_EDGE, 100 }, { GPIO_FALLING_EDGE, 110 }, { POLL, 160 } },
+    { 0 }, { 0 }, 2 },
+  { "glitch on a high line", 50, 1,
+    { { GPIO_FALLING_EDGE, 100 }, { GPIO_RISING_EDGE, 104 }, { POLL, 154 } },
+    { 0 }, { 0 }, 2 },
+  { "bounces then settles high", 50, 0,
+    { { GPIO_RISING_EDGE, 100 }, { GPIO_FALLING_EDGE, 105 }, { GPIO_RISING_EDGE, 108 },
+      { GPIO_FALLING_EDGE, 112 }, { GPIO_RISING_EDGE, 115 }, { POLL, 165 } },
+    { GPIO_RISING_EDGE }, { 100 }, 4 },
+  { "early polls do not pass a bouncing line", 50, 0,
+    { { GPIO_RISING_EDGE, 100 }, { POLL, 130 }, { GPIO_FALLING_EDGE, 140 }, { POLL, 170 },
+      { GPIO_RISING_EDGE, 180 }, { POLL, 229 }, { POLL, 230 } },
+    { GPIO_RISING_EDGE }, { 100 }, 2 },
+  { "settled burst read before the next edge", 50, 0,
+    { { GPIO_RISING_EDGE, 100 }, { GPIO_FALLING_EDGE, 300 }, { POLL, 400 } },
+    { GPIO_RISING_EDGE, GPIO_FALLING_EDGE }, { 100, 300 }, 0 },
+  { "unknown level passes the first burst", 50, -1,
+    { { GPIO_RISING_EDGE, 100 }, { GPIO_FALLING_EDGE, 110 }, { POLL, 160 } },
+    { GPIO_FALLING_EDGE }, { 110 }, 1 },
+};
+
+
+bool replay(const ReplayCase *c)
+{
+  Debouncer d;
+  debounce_init(&d, c->settle_us * 1000ULL);
+  d.stable_level = c->level;
+  int edges[REPLAY_STEPS];
+  unsigned long long edge_us[REPLAY_STEPS];
+  int count = 0;
+  for (int i = 0; i < REPLAY_STEPS && c->steps[i].us != 0; i ++)
+  {
+    const ReplayStep *step = &c->steps[i];
+    unsigned long long timestamp;
+    int edge = (step->edge == POLL) ? debounce_poll(&d, step->us * 1000ULL, &timestamp)
+      : debounce_feed(&d, step->edge, step->us * 1000ULL, &timestamp);
+    if (edge != 0)
+    {
+      edges[count] = edge;
+      edge_us[count ++] = timestamp / 1000;
+    }
+  }
+  bool ok = (d.suppressed == c->suppressed);
+  for (int i = 0; i < REPLAY_EDGES && (i < count || c->edges[i] != 0); i ++)
+  {
+    ok = ok && i < count && edges[i] == c->edges[i] && edge_us[i] == c->edge_us[i];
+  }
+  if (!ok)
+  {
+    printf("FAIL %s:", c->name);
+    for (int i = 0; i < count; i ++)
+    {
+      printf(" %s@%llu", edges[i] == GPIO_RISING_EDGE ? "rising" : "falling", edge_us[i]);
+    }
+    printf(", %lu suppressed\n", d.suppressed);
+  }
+  return ok;
+}
+
+
+int test_debounce()
+{
+  int cases = sizeof(replay_cases) / sizeof(replay_cases[0]);
+  int failed = 0;
+  for (int i = 0; i < cases; i ++)
+  {
+    if (!replay(&replay_cases[i]))
+    {
+      failed ++;
+    }
+  }
+  printf("debounce: %d of %d replays passed\n", cases - failed, cases);
+  return failed;
+}
+
+
+// "vgp -c \"mode 4C2 out; mode ZZZ\"": the failing command exits while the
+// batch still holds back the store of the one before it
+int test_batch_exit()
+{
+  char file[64];
+  snprintf(file, sizeof(file), "/tmp/vgptest-registers-%d", getpid());
+  setenv("VGP_MEM_FILE", file, 1);
+  setenv("VGP_REGISTER_LOCK", "/tmp/vgptest-registers.lock", 1);
+  setenv("VGP_NO_DAEMON", "1", 1);
+  unlink(file);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    set_register_backend(REGISTER_BACKEND_MEM);
+    begin_register_batch();
+    set_dir(4, 18, GPIO_OUTPUT);
+    exit(EXIT_FAILURE);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  set_register_backend(REGISTER_BACKEND_MEM);
+  int dir = get_dir(4, 18);
+  close_register_backend();
+  unlink(file);
+  bool ok = (dir == GPIO_OUTPUT);
+  printf("batch: %s\n", ok ? "writes before a failing command are flushed" : "FAIL writes before a failing command are lost");
+  return ok ? 0 : 1;
+}
+
+
+// header pin 7 (4D1) triggers both rules, the later one wins on 4C4
+int test_reflex()
+{
+  set_register_backend(REGISTER_BACKEND_SIM);
+  set_dir(4, 20, GPIO_OUTPUT);
+  set_dir(4, 19, GPIO_OUTPUT);
+  ReflexRule rules[3] = { { 7, GPIO_RISING_EDGE }, { 7, GPIO_BOTH_EDGES } };
+  bank_write_init(&rules[0].write);
+  bank_write_add(&rules[0].write, 4, 20, 1);
+  bank_write_init(&rules[1].write);
+  bank_write_add(&rules[1].write, 4, 20, 0);
+  bank_write_add(&rules[1].write, 4, 19, 1);
+  static ReflexAction actions[MONITOR_PINS][2];
+  const unsigned int both = (1u << 20) | (1u << 19);
+  bool ok = reflex_merge(rules, 2, actions) == 0
+    && actions[7][0].rules == 2 && actions[7][0].write.mask[4] == both && actions[7][0].write.value[4] == (1u << 19)
+    && actions[7][1].rules == 1 && actions[7][1].write.mask[4] == both && actions[7][1].write.value[4] == (1u << 19)
+    && actions[8][0].rules == 0 && actions[7][0].write.mask[2] == 0;
+
+  // a pin driving itself and a target that is still an input are refused
+  rules[2] = (ReflexRule){ 7, GPIO_FALLING_EDGE };
+  bank_write_init(&rules[2].write);
+  bank_write_add(&rules[2].write, 4, 25, 1);
+  ok = ok && reflex_merge(rules, 3, actions) < 0;
+  bank_write_init(&rules[2].write);
+  bank_write_add(&rules[2].write, 2, 0, 1);
+  ok = ok && reflex_merge(rules, 3, actions) < 0;
+  close_register_backend();
+  printf("reflex: %s\n", ok ? "rules merge per pin and edge" : "FAIL rules do not merge per pin and edge");
+  return ok ? 0 : 1;
+}
+
+
+int main(int argc, char *const *argv)
+{
+  int failed = test_debounce();
+  failed += test_batch_exit();
+  failed += test_reflex();
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -65,7 +65,7 @@ void add_class(GtkWidget *widget, const char *cls)
 
 
 gboolean refresh_pin_state(gpointer p) {
-  MonitorThread * params = (MonitorThread *)p;
+  MonitorPin * params = (MonitorPin *)p;
   int col = flipped ? ((params->pin - 1) / 2) : (19 - (params->pin - 1) / 2);
   int row = (params->pin % 2) ? 7 : 0;
   GtkWidget * value_button = gtk_grid_get_child_at(GTK_GRID(grid), col, row);
@@ -97,37 +97,26 @@ void on_pin_state_changed(void *p)
 }
 
 
-void init_monitor_threads(void (*callback)(void*))
+void init_monitors(void (*callback)(void*))
 {
-  monitor_threads[0] = NULL;
-  for (int pin = 1; pin < MONITOR_THREADS; pin ++) {
+  for (int pin = 1; pin < MONITOR_PINS; pin ++) {
     int col = flipped ? ((pin - 1) / 2) : (19 - (pin - 1) / 2);
     int row = (pin % 2) ? 6 : 1;
     GtkWidget * mode_button = gtk_grid_get_child_at(GTK_GRID(grid), col, row);
     const char* mode = gtk_button_get_label(GTK_BUTTON(mode_button));
     if (strcmp(mode, IN) == 0)
     {
-      create_monitor_thread(pin, 0, GPIO_BOTH_EDGES, callback);
-    }
-    else
-    {
-      monitor_threads[pin] = NULL;
+      monitor_add_pin(pin, GPIO_BOTH_EDGES, callback);
     }
   }
 }
 
 
-void update_pin_info(int pin, bool flipped)
+void show_pin_info(int pin, bool flipped, int alt, int dir, int val)
 {
-  char * pin_name = (char *)NAMES[pin];
-  int ch = get_chip_number(pin_name);
-  int ln = get_line_number(pin_name);
   char mode[5];
-  int alt = get_alt(ch, ln);
-  int dir = 0;
   if (alt == 0)
   {
-    dir = get_dir(ch, ln);
     if (dir == 0)
     {
       strcpy(mode, IN);
@@ -171,7 +160,6 @@ void update_pin_info(int pin, bool flipped)
     gtk_button_set_label(GTK_BUTTON(mode_button), mode);
   }
   
-  int val = get(ch, ln);
   char value[3];
   sprintf(value, "%d", val);
   
@@ -185,13 +173,34 @@ void update_pin_info(int pin, bool flipped)
 }
 
 
+void update_pin_info(int pin, bool flipped)
+{
+  char * pin_name = (char *)NAMES[pin];
+  int ch = get_chip_number(pin_name);
+  int ln = get_line_number(pin_name);
+  int alt = get_alt(ch, ln);
+  int dir = (alt == 0) ? get_dir(ch, ln) : 0;
+  show_pin_info(pin, flipped, alt, dir, get(ch, ln));
+}
+
+
 void load_all_pin_info()
 {
+  BoardSnapshot snapshot;
+  if (read_board_snapshot(&snapshot) < 0)
+  {
+    return;
+  }
   for (int pin = 1; pin <= 40; pin ++)
   {
     if (!is_power_pin(pin))
     {
-      update_pin_info(pin, flipped);
+      char * pin_name = (char *)NAMES[pin];
+      int ch = get_chip_number(pin_name);
+      int ln = get_line_number(pin_name);
+      int alt = snapshot_get_alt(&snapshot, ch, ln);
+      int dir = (alt == 0) ? snapshot_get_dir(&snapshot, ch, ln) : 0;
+      show_pin_info(pin, flipped, alt, dir, snapshot_get_value(&snapshot, ch, ln));
     }
   }
 }
@@ -277,26 +286,20 @@ void mode_button_clicked(GtkButton *button, gpointer data)
     {
       int dir = get_dir(ch, ln);
       int new_dir = get_dir_by_mode(new_mode);
-      if (new_dir == 0)
-      {
-        // ALT3->IN: create monitor thread
-        create_monitor_thread(pin, 1, GPIO_BOTH_EDGES, on_pin_state_changed);
-      }
-      else if (new_dir == 1)
+      if (new_dir == 1)
       {
-        // IN->OUT: cancel monitor thread
-        if (monitor_threads[pin] != NULL)
-        {
-          pthread_cancel(monitor_threads[pin]->thread);
-          pthread_join(monitor_threads[pin]->thread, NULL);
-          free(monitor_threads[pin]);
-          monitor_threads[pin] = NULL;
-        }
+        // IN->OUT: stop monitoring the pin
+        monitor_remove_pin(pin);
       }
       if (new_dir != dir)
       {
         set_dir(ch, ln, new_dir); 
       }
+      if (new_dir == 0)
+      {
+        // ALT3->IN: start monitoring the pin
+        monitor_add_pin(pin, GPIO_BOTH_EDGES, on_pin_state_changed);
+      }
     }
   }
   update_pin_info(pin, flipped);
@@ -354,6 +357,29 @@ void flip_view()
 }
 
 
+void show_stats()
+{
+  char *text = NULL;
+  size_t size = 0;
+  FILE *f = open_memstream(&text, &size);
+  if (f == NULL)
+  {
+    return;
+  }
+  write_op_stats(f, false);
+  fclose(f);
+  GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(gtk_widget_get_toplevel(grid)), GTK_DIALOG_DESTROY_WITH_PARENT,
+    GTK_MESSAGE_INFO, GTK_BUTTONS_CLOSE, "Operation statistics");
+  GtkWidget *label = gtk_label_new(text);
+  add_class(label, "stats");
+  gtk_container_add(GTK_CONTAINER(gtk_message_dialog_get_message_area(GTK_MESSAGE_DIALOG(dialog))), label);
+  gtk_widget_show_all(dialog);
+  gtk_dialog_run(GTK_DIALOG(dialog));
+  gtk_widget_destroy(dialog);
+  free(text);
+}
+
+
 int main(int argc, char *argv[])
 {
   make_sure_single_instance();
@@ -468,7 +494,7 @@ int main(int argc, char *argv[])
   
   load_all_pin_info();
   
-  init_monitor_threads(on_pin_state_changed);
+  init_monitors(on_pin_state_changed);
   
   // bottom bar
   label = gtk_label_new(NULL);
@@ -478,9 +504,14 @@ int main(int argc, char *argv[])
   adc_label = gtk_label_new("A0 = 0 (0.000V),  A3 = 0 (0.000V),  A4 = 0 (0.000V)");
   gtk_label_set_xalign(GTK_LABEL(adc_label), 0.0);
   gtk_widget_set_size_request(adc_label, GRID_WIDTH, GRID_HEIGHT);
-  gtk_grid_attach(GTK_GRID(grid), adc_label, 0, 9, 19, 1);
+  gtk_grid_attach(GTK_GRID(grid), adc_label, 0, 9, 18, 1);
   g_timeout_add(1000, refresh_adc_state, NULL);
   
+  button = gtk_button_new_with_label("Stats");
+  gtk_widget_set_size_request(button, GRID_WIDTH, GRID_HEIGHT);
+  g_signal_connect(button, "clicked", G_CALLBACK(show_stats), NULL);
+  gtk_grid_attach(GTK_GRID(grid), button, 18, 9, 1, 1);
+
   button = gtk_button_new_with_label("Flip");
   gtk_widget_set_size_request(button, GRID_WIDTH, GRID_HEIGHT);
   g_signal_connect(button, "clicked", G_CALLBACK(flip_view), grid);